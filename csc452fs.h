@@ -0,0 +1,340 @@
+/*
+	On-disk format of csc452 images, shared by the FUSE driver and the
+	tools that work on an image while it is not mounted.
+*/
+
+#ifndef CSC452FS_H
+#define CSC452FS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+//block sizes an image may be formatted with. A formatted image records
+//its own block size in the superblock.
+#define    DEFAULT_BLOCK_SIZE 4096
+#define    MIN_BLOCK_SIZE 512
+#define    MAX_BLOCK_SIZE 65536
+
+//longest name a directory entry can have, as NAME_MAX
+#define    MAX_NAME 255
+
+//What a directory entry names
+#define CSC452_TYPE_FILE 0
+#define CSC452_TYPE_DIR 1
+
+/**
+ * First block of a directory, and the root of its index. A directory is an
+ * extendible hash: the table has 1 << depth slots, and slot s points at the
+ * bucket holding every name whose name_hash has s in its low depth bits.
+ * Several slots share a bucket when its own depth is lower. While the
+ * table has no more than CSC452_DIR_INLINE_SLOTS it lives here; past that
+ * it moves to blocks of its own and table[] lists them instead. The root
+ * is the directory whose first block is rootBlock, and a block of zeros is
+ * an empty directory.
+ *
+ * Every block of a directory, first, table and buckets, is in one FAT
+ * chain starting at the first block, in no particular order after it.
+ */
+struct csc452_dir_header {
+    uint32_t depth;         //the table has 1 << depth slots
+    uint32_t nTableBlocks;  //0 while the table fits here
+    uint64_t nEntries;      //entries in the whole directory
+    uint32_t table[];       //bucket blocks by slot, or the table's blocks
+};
+
+//Table slots kept in the first block, and in each block of a table that
+//has moved out of it
+#define CSC452_DIR_INLINE_SLOTS(bs) ((bs) / 8)
+#define CSC452_DIR_SLOTS_PER_BLOCK(bs) ((bs) / sizeof(uint32_t))
+
+//Most blocks a directory's table can take (a power of two)
+#define CSC452_DIR_MAX_TABLE_BLOCKS(bs) ((bs) / 8)
+
+/**
+ * A bucket of a directory. Every name in it agrees on the low depth bits
+ * of its hash. A bucket only splits when it is full, and buckets are never
+ * merged, so one may be empty.
+ *
+ * Entries are fixed size and grow up from the start of the block; their
+ * names, without a nul, are packed down from its end. A bucket is full
+ * when the two would meet. Scans compare the hash kept in each entry and
+ * only look at a name when that matches.
+ */
+//The attribute packed means to not align these things
+struct csc452_directory_entry {
+    int32_t nFiles;    //How many entries are in this bucket.
+    uint32_t depth;    //bits of the hash its names agree on
+    uint32_t nameBytes; //bytes of names at the end of the block
+
+    struct csc452_file_directory {
+        uint64_t fsize;                  //file size, 0 for a directory
+        uint32_t nStartBlock;            //block number of the first block
+        uint32_t hash;                   //name_hash of the name
+        uint16_t nameOffset;             //where in the block the name starts
+        uint8_t nameLen;                 //bytes in the name, 1 to MAX_NAME
+        uint8_t type;                    //CSC452_TYPE_*
+    } __attribute__((packed)) files[];    //As many of these as fit in a block
+};
+
+//Bytes a bucket has for entries and their names
+#define CSC452_BUCKET_SPACE(bs) ((bs) - offsetof(struct csc452_directory_entry, files))
+
+//Bytes an entry whose name is len bytes takes in a bucket
+#define CSC452_ENTRY_BYTES(len) (sizeof(struct csc452_file_directory) + (len))
+
+//Most entries a bucket can hold, every name one byte
+#define CSC452_FILES_PER_DIR(bs) (CSC452_BUCKET_SPACE(bs) / CSC452_ENTRY_BYTES(1))
+
+typedef struct csc452_directory_entry csc452_directory_entry;
+
+//Identifies a formatted image and the layout it uses
+#define CSC452_MAGIC "CSC452FS"
+#define CSC452_VERSION 5
+
+//superblock features
+#define CSC452_FEATURE_JOURNAL 1u   //metadata journal after the root
+#define CSC452_FEATURES CSC452_FEATURE_JOURNAL
+
+/**
+ * Block 0 of the image. The geometry is chosen when the image is formatted
+ * and recorded here. The first block of the root directory follows in
+ * block 1, then the journal if there is one, then data blocks, and the FAT
+ * fills the last fatBlocks blocks of the image.
+ */
+struct csc452_superblock {
+    char magic[8];          //CSC452_MAGIC, not nul terminated
+    uint32_t version;       //CSC452_VERSION
+    uint32_t blockSize;     //bytes per block, a power of two in 512..65536
+    uint64_t diskSize;      //bytes in the image
+    uint64_t nBlocks;       //blocks in the image, each with a FAT entry
+    uint64_t fatStart;      //first block of the FAT region
+    uint64_t fatBlocks;     //blocks in the FAT region
+    uint64_t rootBlock;     //first block of the root directory
+    uint32_t features;      //CSC452_FEATURE_* in use
+    uint64_t journalStart;  //first block of the journal, with FEATURE_JOURNAL
+    uint64_t journalBlocks; //blocks in the journal
+} __attribute__((packed));
+
+typedef struct csc452_superblock csc452_superblock;
+
+#define CSC452_JOURNAL_MAGIC "CSC452JH"
+
+//journal size when formatting: 1/256 of the image within these bounds
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024
+
+/**
+ * First block of the journal. It describes the last metadata transaction:
+ * nImages block images follow it in the journal, and targets[i] is where
+ * image i belongs. The checksum covers the sequence number, the targets
+ * and the images, so a transaction torn by a crash is never replayed.
+ */
+struct csc452_journal_header {
+    char magic[8];          //CSC452_JOURNAL_MAGIC, not nul terminated
+    uint64_t sequence;      //grows by one with every transaction
+    uint32_t nImages;
+    uint32_t checksum;
+    uint64_t targets[];
+} __attribute__((packed));
+
+//FAT entries are 32 bits. Anything else is the number of the next block.
+#define FAT_FREE 0
+#define FAT_EOC 0xFFFFFFFFu         //last block of a chain
+#define FAT_RESERVED 0xFFFFFFFEu    //superblock and FAT blocks, never allocated
+
+//How many FAT entries fit in one block of the FAT region?
+#define CSC452_FAT_PER_BLOCK(bs) ((bs) / sizeof(uint32_t))
+
+/**
+ * Is bs a block size an image may have?
+ */
+static inline int valid_block_size(uint32_t bs)
+{
+    return bs >= MIN_BLOCK_SIZE && bs <= MAX_BLOCK_SIZE && (bs & (bs - 1)) == 0;
+}
+
+/**
+ * Checks that the superblock describes a geometry this code understands
+ * @return 1 if it does, 0 if not
+ */
+static inline int check_superblock(const csc452_superblock *sb, off_t imageSize)
+{
+    uint32_t bs = sb->blockSize;
+
+    if (memcmp(sb->magic, CSC452_MAGIC, sizeof(sb->magic)) != 0 || sb->version != CSC452_VERSION ||
+        (sb->features & ~CSC452_FEATURES) != 0) {
+        return 0;
+    }
+    if ((sb->features & CSC452_FEATURE_JOURNAL) &&
+        (sb->journalStart != sb->rootBlock + 1 || sb->journalBlocks < 2 ||
+         sb->journalStart + sb->journalBlocks >= sb->fatStart)) {
+        return 0;
+    }
+    return valid_block_size(bs) && (off_t) sb->diskSize <= imageSize &&
+           sb->nBlocks == sb->diskSize / bs &&
+           sb->fatBlocks == (sb->nBlocks * sizeof(uint32_t) + bs - 1) / bs &&
+           sb->fatStart == sb->nBlocks - sb->fatBlocks &&
+           sb->rootBlock == 1 && sb->fatStart > sb->rootBlock + 1;
+}
+
+/**
+ * Lays out a new image covering imageSize bytes: superblock, root, the
+ * journal when the image can spare it, data blocks and the FAT at the end
+ * @return 0 on success, or -EINVAL if the image is too small or too big
+ */
+static inline int plan_superblock(csc452_superblock *sb, off_t imageSize, uint32_t blockSize)
+{
+    uint64_t nBlocks = imageSize / blockSize;
+    uint64_t fatBlocks = (nBlocks * sizeof(uint32_t) + blockSize - 1) / blockSize;
+
+    if (!valid_block_size(blockSize) || nBlocks >= FAT_RESERVED || nBlocks <= fatBlocks + 2) {
+        return -EINVAL;
+    }
+
+    // Images too small to spare the journal a fifth of their data go without
+    uint64_t journalBlocks = nBlocks / 256;
+    journalBlocks = journalBlocks < JOURNAL_MIN_BLOCKS ? JOURNAL_MIN_BLOCKS :
+                    journalBlocks > JOURNAL_MAX_BLOCKS ? JOURNAL_MAX_BLOCKS : journalBlocks;
+    if (nBlocks - fatBlocks - 2 < 5 * journalBlocks) {
+        journalBlocks = 0;
+    }
+
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->magic, CSC452_MAGIC, sizeof(sb->magic));
+    sb->version = CSC452_VERSION;
+    sb->blockSize = blockSize;
+    sb->diskSize = nBlocks * blockSize;
+    sb->nBlocks = nBlocks;
+    sb->fatBlocks = fatBlocks;
+    sb->fatStart = nBlocks - fatBlocks;
+    sb->rootBlock = 1;
+    if (journalBlocks > 0) {
+        sb->features |= CSC452_FEATURE_JOURNAL;
+        sb->journalStart = 2;
+        sb->journalBlocks = journalBlocks;
+    }
+    return 0;
+}
+
+/**
+ * The FAT entry block n has on a new image: the root is an empty
+ * directory of one block, the superblock, journal and FAT are reserved and
+ * the rest is free
+ */
+static inline uint32_t initial_fat_entry(const csc452_superblock *sb, uint64_t n)
+{
+    if (n == sb->rootBlock) {
+        return FAT_EOC;
+    }
+    if (n == 0 || (n >= sb->journalStart && n < sb->journalStart + sb->journalBlocks) ||
+        (n >= sb->fatStart && n < sb->nBlocks)) {
+        return FAT_RESERVED;
+    }
+    return FAT_FREE;
+}
+
+/**
+ * Folds len bytes into an FNV-1a hash
+ */
+static inline uint32_t checksum(uint32_t hash, const void *buf, size_t len)
+{
+    const unsigned char *c = buf;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ c[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Hashes a name of len bytes for the directory index (FNV-1a). Changing it
+ * changes the on-disk format.
+ */
+static inline uint32_t name_hash(const char *name, size_t len)
+{
+    return checksum(2166136261u, name, len);
+}
+
+/**
+ * A hash with its bits in reverse. Every bucket holds the names whose
+ * hashes agree in their low bits, so in this order each bucket's names
+ * are one run, and splitting a bucket cuts its run in two.
+ */
+static inline uint32_t hash_order(uint32_t hash)
+{
+    hash = (hash >> 16) | (hash << 16);
+    hash = ((hash >> 8) & 0x00ff00ff) | ((hash & 0x00ff00ff) << 8);
+    hash = ((hash >> 4) & 0x0f0f0f0f) | ((hash & 0x0f0f0f0f) << 4);
+    hash = ((hash >> 2) & 0x33333333) | ((hash & 0x33333333) << 2);
+    return ((hash >> 1) & 0x55555555) | ((hash & 0x55555555) << 1);
+}
+
+/**
+ * Bytes left in a bucket for another entry and its name
+ */
+static inline size_t bucket_room(uint32_t bs, const csc452_directory_entry *bucket)
+{
+    return CSC452_BUCKET_SPACE(bs) - bucket->nFiles * sizeof(struct csc452_file_directory) - bucket->nameBytes;
+}
+
+/**
+ * Adds an entry to the end of a bucket that has room for it, packing its
+ * name in below the others. The name must not be in the bucket's block.
+ * @return the entry, zeroed but for its name and hash
+ */
+static inline struct csc452_file_directory *bucket_add(uint32_t bs, csc452_directory_entry *bucket,
+                                                       const char *name, size_t len)
+{
+    struct csc452_file_directory *f = &bucket->files[bucket->nFiles++];
+    bucket->nameBytes += len;
+    memset(f, 0, sizeof(*f));
+    f->nameOffset = bs - bucket->nameBytes;
+    f->nameLen = len;
+    f->hash = name_hash(name, len);
+    memcpy((char *) bucket + f->nameOffset, name, len);
+    return f;
+}
+
+/**
+ * Deepest a directory's table can go: one slot per hash bit pattern of the
+ * largest table
+ */
+static inline uint32_t dir_max_depth(uint32_t bs)
+{
+    uint64_t slots = (uint64_t) CSC452_DIR_MAX_TABLE_BLOCKS(bs) * CSC452_DIR_SLOTS_PER_BLOCK(bs);
+    uint32_t depth = 0;
+    while (((uint64_t) 1 << (depth + 1)) <= slots) {
+        depth++;
+    }
+    return depth;
+}
+
+/**
+ * Blocks one transaction can hold: what the journal has after its header,
+ * but no more than the header has targets for
+ */
+static inline long journal_capacity(uint32_t blockSize, uint64_t journalBlocks)
+{
+    long cap = journalBlocks - 1;
+    long targets = (blockSize - sizeof(struct csc452_journal_header)) / sizeof(uint64_t);
+    return cap < targets ? cap : targets;
+}
+
+/**
+ * Checksums a transaction's header fields, targets and images
+ */
+static inline uint32_t journal_checksum(const struct csc452_journal_header *header, char **images,
+                                        uint32_t blockSize)
+{
+    uint32_t hash = checksum(2166136261u, &header->sequence, sizeof(header->sequence));
+    hash = checksum(hash, &header->nImages, sizeof(header->nImages));
+    hash = checksum(hash, header->targets, header->nImages * sizeof(uint64_t));
+    for (uint32_t i = 0; i < header->nImages; i++) {
+        hash = checksum(hash, images[i], blockSize);
+    }
+    return hash;
+}
+
+#endif
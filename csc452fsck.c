@@ -0,0 +1,1391 @@
+/*
+	Checks a csc452 image that is not mounted, and repairs it with -y.
+
+	gcc -Wall -O2 -pthread csc452fsck.c -o csc452fsck
+
+	csc452fsck [-n | -y] [-v] [-j threads] [image]
+
+	The image defaults to .disk. With -n, the default, nothing is written
+	and the report says what -y would change. The exit status follows the
+	fsck convention: 0 when the image is clean, 1 when every problem was
+	repaired, 4 when problems were left alone and 8 when the image could
+	not be checked at all.
+
+	FAT chains are walked in parallel, claiming blocks in a shared bitmap,
+	so a block reached by two chains is caught by whichever walk gets there
+	second and that chain is cut before it. Which of two cross-linked files
+	keeps the shared blocks depends on timing; -j 1 makes it repeatable.
+	Directories are walked from the root first, one at a time, so of two
+	entries for the same directory the one found first keeps it. A
+	directory with anything wrong in its table or buckets, or entries that
+	had to go, is laid out again from the entries that are left, in as few
+	blocks as hold them.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "csc452fs.h"
+
+//worker threads for the chain and leak passes, unless -j N is given
+#define FSCK_MAX_THREADS 16
+
+//exit status, as other fsck tools use it
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_ERROR 8
+
+//How the walk of a chain ended
+#define CHAIN_OK 0          //at FAT_EOC
+#define CHAIN_BAD_LINK 1    //at an entry that isn't a data block
+#define CHAIN_SHARED 2      //at a block another walk had claimed
+
+/**
+ * A chain some entry owns: a file's data or a directory's blocks. Walks
+ * stop before the first block that is wrong, so the blocks counted in
+ * length are the chain's alone and the chain is repaired by ending it at
+ * last.
+ */
+struct fsck_chain {
+    long dir;           //directory holding the entry, or the directory itself
+    long file;          //entry in the directory, -1 for the directory's blocks
+    uint32_t start;
+    long length;        //blocks walked before the end
+    uint32_t last;      //last of those blocks
+    int end;            //CHAIN_*
+    uint32_t link;      //the bad entry or the shared block
+    long with;          //chain that claimed the shared block, or -1
+};
+
+/**
+ * An entry gathered out of a directory's buckets, with its name copied out
+ * and nul terminated. A name that wasn't where its entry said is empty.
+ */
+struct fsck_entry {
+    uint64_t fsize;
+    uint32_t nStartBlock;
+    uint8_t type;
+    uint8_t nameLen;
+    char name[MAX_NAME + 1];
+};
+
+/**
+ * A directory reached from the root. Its entries are gathered out of its
+ * buckets so they can be checked and dropped in place, and a dirty one is
+ * laid out again in image before it is written back.
+ */
+struct fsck_dir {
+    char *path;         //"" for the root
+    long chain;         //its blocks' chain in ck.chains
+    uint32_t *blocks;
+    long nBlocks;
+    struct fsck_entry *files;
+    long nFiles;
+    int dirty;
+    char *image;        //nBlocks blocks to write over blocks, once laid out
+};
+
+/**
+ * A bucket of a directory being laid out: the entries from..from+n, once
+ * sorted, are the ones whose hashes have pattern in their low depth bits
+ */
+struct fsck_bucket {
+    uint32_t pattern;
+    uint32_t depth;
+    long from;
+    long n;
+};
+
+/**
+ * A block of a directory's chain, for finding where in it a table slot points
+ */
+struct fsck_index {
+    uint32_t block;
+    long k;
+};
+
+/**
+ * Work for one thread in a parallel pass
+ */
+struct fsck_work {
+    pthread_t thread;
+    int started;
+    long from;
+    long to;
+    long count;
+};
+
+struct fsck {
+    const char *image;
+    int fd;
+    int repair;
+    int verbose;
+    int nThreads;
+
+    csc452_superblock sb;
+    uint32_t bs;
+    long dataStart;                         //first block a chain may use
+    long perFatBlock;
+
+    struct csc452_journal_header *journal;  //a whole transaction, or NULL
+    char *journalImages;
+
+    uint32_t *fat;
+    char *fatDirty;                         //one flag per FAT block
+    uint64_t *claimed;                      //a bit per block reached by a chain
+
+    struct fsck_dir *dirs;                  //in the order they were reached
+    long nDirs;
+    long capDirs;
+
+    struct fsck_chain *chains;              //directories' first, then files'
+    long nChains;
+    long capChains;
+    long nextChain;                         //taken atomically by the workers
+
+    long nextFree;                          //where to look for a block to lay a directory out in
+    long problems;
+    long nFiles;
+    long unsized;                           //files with blocks past their size
+};
+
+static struct fsck ck;
+
+/**
+ * Reports a problem. Repairs are made in memory whether or not -y was
+ * given, so the rest of the check sees the image as -y would leave it.
+ */
+static void problem(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(ck.repair ? " (fixed)\n" : "\n");
+    ck.problems++;
+}
+
+/**
+ * pread until done
+ * @return 0 on success, or negative errno
+ */
+static int read_all(void *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(ck.fd, buf, len, offset);
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        buf = (char *) buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * pwrite until done
+ * @return 0 on success, or negative errno
+ */
+static int write_all(const void *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(ck.fd, buf, len, offset);
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        buf = (const char *) buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Is block somewhere a chain may go?
+ */
+static int data_block(uint32_t block)
+{
+    return block >= (uint64_t) ck.dataStart && block < ck.sb.fatStart;
+}
+
+/**
+ * Reads a metadata block as the driver would see it after mounting, with
+ * the journal's last transaction applied
+ * @return 0 on success, or negative errno
+ */
+static int read_meta(void *buf, long block)
+{
+    int res = read_all(buf, ck.bs, (off_t) block * ck.bs);
+    for (uint32_t i = 0; res == 0 && ck.journal != NULL && i < ck.journal->nImages; i++) {
+        if (ck.journal->targets[i] == (uint64_t) block) {
+            memcpy(buf, ck.journalImages + (size_t) i * ck.bs, ck.bs);
+        }
+    }
+    return res;
+}
+
+/**
+ * Reads the journal's transaction if it is whole. The driver replays it
+ * on every mount, so the check treats it as already applied.
+ * @return 0 on success, or negative errno
+ */
+static int load_journal()
+{
+    if (!(ck.sb.features & CSC452_FEATURE_JOURNAL)) {
+        return 0;
+    }
+
+    struct csc452_journal_header *header = malloc(ck.bs);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+    int res = read_all(header, ck.bs, (off_t) ck.sb.journalStart * ck.bs);
+    if (res != 0 || memcmp(header->magic, CSC452_JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->nImages == 0 || header->nImages > journal_capacity(ck.bs, ck.sb.journalBlocks)) {
+        free(header);
+        return res;
+    }
+
+    uint32_t n = header->nImages;
+    char *data = malloc((size_t) n * ck.bs);
+    char **images = malloc(n * sizeof(char *));
+    if (data == NULL || images == NULL) {
+        res = -ENOMEM;
+    } else {
+        res = read_all(data, (size_t) n * ck.bs, (off_t) (ck.sb.journalStart + 1) * ck.bs);
+    }
+    int whole = res == 0;
+    for (uint32_t i = 0; whole && i < n; i++) {
+        images[i] = data + (size_t) i * ck.bs;
+        uint64_t t = header->targets[i];
+        whole = t >= ck.sb.rootBlock && t < ck.sb.nBlocks &&
+                (t < ck.sb.journalStart || t >= ck.sb.journalStart + ck.sb.journalBlocks);
+    }
+    if (whole && journal_checksum(header, images, ck.bs) == header->checksum) {
+        if (ck.verbose) {
+            printf("journal transaction %llu applied\n", (unsigned long long) header->sequence);
+        }
+        ck.journal = header;
+        ck.journalImages = data;
+        data = NULL;
+        header = NULL;
+    }
+    free(images);
+    free(data);
+    free(header);
+    return res;
+}
+
+/**
+ * Reads the FAT, with any FAT blocks from the journal applied
+ * @return 0 on success, or negative errno
+ */
+static int load_fat()
+{
+    ck.fat = malloc((size_t) ck.sb.fatBlocks * ck.bs);
+    ck.fatDirty = calloc(ck.sb.fatBlocks, 1);
+    ck.claimed = calloc((ck.sb.nBlocks + 63) / 64, sizeof(uint64_t));
+    if (ck.fat == NULL || ck.fatDirty == NULL || ck.claimed == NULL) {
+        return -ENOMEM;
+    }
+    int res = read_all(ck.fat, (size_t) ck.sb.fatBlocks * ck.bs, (off_t) ck.sb.fatStart * ck.bs);
+    for (uint32_t i = 0; res == 0 && ck.journal != NULL && i < ck.journal->nImages; i++) {
+        uint64_t t = ck.journal->targets[i];
+        if (t >= ck.sb.fatStart) {
+            memcpy((char *) ck.fat + (size_t) (t - ck.sb.fatStart) * ck.bs,
+                   ck.journalImages + (size_t) i * ck.bs, ck.bs);
+        }
+    }
+    return res;
+}
+
+/**
+ * Changes a FAT entry in memory and marks its block for writing
+ */
+static void set_fat(long block, uint32_t val)
+{
+    ck.fat[block] = val;
+    __atomic_store_n(&ck.fatDirty[block / ck.perFatBlock], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Claims a block for the chain walking it
+ * @return 1 if another walk had claimed it already, 0 if not
+ */
+static int claim(uint32_t block)
+{
+    uint64_t bit = (uint64_t) 1 << (block % 64);
+    return (__atomic_fetch_or(&ck.claimed[block / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/**
+ * Checks the entries for blocks the layout owns: the superblock, the
+ * journal and the FAT are reserved and the root's chain starts at its block
+ */
+static void check_layout()
+{
+    for (long i = 0; i < (long) ck.sb.fatStart + (long) ck.sb.fatBlocks; i++) {
+        if (i == ck.dataStart) {
+            i = ck.sb.fatStart;
+        }
+        if (i == (long) ck.sb.rootBlock) {
+            if (ck.fat[i] != FAT_EOC && !data_block(ck.fat[i])) {
+                problem("FAT entry for the root block is %#x, not a data block or end of chain", ck.fat[i]);
+                set_fat(i, FAT_EOC);
+            }
+        } else if (ck.fat[i] != FAT_RESERVED) {
+            problem("FAT entry for reserved block %ld is %#x", i, ck.fat[i]);
+            set_fat(i, FAT_RESERVED);
+        }
+    }
+}
+
+/**
+ * Is an entry's name one a path can reach: not empty, and without a '/'
+ * or a nul in it?
+ */
+static int valid_name(const struct fsck_entry *f)
+{
+    return f->nameLen > 0 && memchr(f->name, '/', f->nameLen) == NULL && memchr(f->name, '\0', f->nameLen) == NULL;
+}
+
+/**
+ * A directory's path for reports
+ */
+static const char *dir_name(const struct fsck_dir *d)
+{
+    return d->path[0] != '\0' ? d->path : "/";
+}
+
+/**
+ * Writes the path of an entry in d into buf
+ */
+static void entry_name(char *buf, size_t size, const struct fsck_dir *d, const struct fsck_entry *f)
+{
+    snprintf(buf, size, "%s/%.*s", d->path, (int) f->nameLen, f->name);
+}
+
+//the entries being sorted by compare_files, and their hashes for compare_hashes
+static struct fsck_entry *sortFiles;
+static uint32_t *sortHashes;
+
+static int compare_files(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    int c = strcmp(sortFiles[x].name, sortFiles[y].name);
+    return c != 0 ? c : (x > y) - (x < y);
+}
+
+//Names sorted by hash_order put each bucket's names in one run and the two
+//halves of a split in two runs
+static int compare_hashes(const void *a, const void *b)
+{
+    uint32_t x = hash_order(sortHashes[*(const long *) a]), y = hash_order(sortHashes[*(const long *) b]);
+    return x < y ? -1 : x > y;
+}
+
+static int compare_index(const void *a, const void *b)
+{
+    uint32_t x = ((const struct fsck_index *) a)->block, y = ((const struct fsck_index *) b)->block;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Adds a chain for the walks
+ * @return its number, or -1 if out of memory
+ */
+static long add_chain(long dir, long file, uint32_t start)
+{
+    if (ck.nChains == ck.capChains) {
+        long cap = ck.capChains == 0 ? 64 : ck.capChains * 2;
+        struct fsck_chain *chains = realloc(ck.chains, cap * sizeof(struct fsck_chain));
+        if (chains == NULL) {
+            return -1;
+        }
+        ck.chains = chains;
+        ck.capChains = cap;
+    }
+    struct fsck_chain *c = &ck.chains[ck.nChains];
+    memset(c, 0, sizeof(*c));
+    c->dir = dir;
+    c->file = file;
+    c->start = start;
+    c->with = -1;
+    return ck.nChains++;
+}
+
+/**
+ * Reports how a chain that didn't reach FAT_EOC ended, and ends it at its
+ * last good block
+ */
+static void end_chain(const char *kind, const char *name, struct fsck_chain *c, long self, const char *other)
+{
+    if (c->end == CHAIN_SHARED && c->with == self) {
+        problem("%s %s loops back to block %u after %ld blocks", kind, name, c->link, c->length);
+    } else if (c->end == CHAIN_SHARED) {
+        problem("%s %s runs into block %u of %s after %ld blocks", kind, name, c->link,
+                other[0] ? other : "another chain", c->length);
+    } else if (c->end == CHAIN_BAD_LINK && c->link == FAT_FREE) {
+        problem("%s %s has block %u marked free", kind, name, c->last);
+    } else if (c->end == CHAIN_BAD_LINK) {
+        problem("%s %s links block %u to %#x, outside the data blocks", kind, name, c->last, c->link);
+    }
+    if (c->end != CHAIN_OK) {
+        set_fat(c->last, FAT_EOC);
+    }
+}
+
+/**
+ * Walks one chain, claiming its blocks until the end or the first block
+ * that is wrong
+ */
+static void walk_chain(struct fsck_chain *c)
+{
+    uint32_t block = c->start;
+    c->length = 0;
+    c->end = CHAIN_OK;
+    c->with = -1;
+    for (;;) {
+        if (claim(block)) {
+            c->end = CHAIN_SHARED;
+            c->link = block;
+            return;
+        }
+        c->length++;
+        c->last = block;
+        uint32_t next = ck.fat[block];
+        if (next == FAT_EOC) {
+            return;
+        }
+        if (!data_block(next)) {
+            c->end = CHAIN_BAD_LINK;
+            c->link = next;
+            return;
+        }
+        block = next;
+    }
+}
+
+/**
+ * Claims a directory's chain and queues the directory to be checked. The
+ * walk is done right away, so a directory reached twice, or from inside
+ * itself, is caught at its second entry.
+ * @return 0 if it was queued, 1 if its first block belongs to another
+ * chain and the entry naming it must go, or negative errno
+ */
+static int add_dir(char *path, uint32_t start)
+{
+    if (ck.nDirs == ck.capDirs) {
+        long cap = ck.capDirs == 0 ? 16 : ck.capDirs * 2;
+        struct fsck_dir *dirs = realloc(ck.dirs, cap * sizeof(struct fsck_dir));
+        if (dirs == NULL) {
+            free(path);
+            return -ENOMEM;
+        }
+        ck.dirs = dirs;
+        ck.capDirs = cap;
+    }
+    long i = add_chain(ck.nDirs, -1, start);
+    if (i < 0) {
+        free(path);
+        return -ENOMEM;
+    }
+
+    struct fsck_chain *c = &ck.chains[i];
+    walk_chain(c);
+    if (c->length == 0) {
+        problem("directory %s starts at block %u, which belongs to another chain", path, start);
+        ck.nChains--;
+        free(path);
+        return 1;
+    }
+    // The other chains aren't known yet, but a loop can be told
+    uint32_t block = c->start;
+    for (long k = 0; c->end == CHAIN_SHARED && k < c->length; k++, block = ck.fat[block]) {
+        if (block == c->link) {
+            c->with = i;
+        }
+    }
+
+    struct fsck_dir *d = &ck.dirs[ck.nDirs++];
+    memset(d, 0, sizeof(*d));
+    d->path = path;
+    d->chain = i;
+    end_chain("directory", dir_name(d), c, i, "");
+    return 0;
+}
+
+/**
+ * Finds which block of a directory's chain block is
+ * @return its place in the chain, or -1 if the chain doesn't have it
+ */
+static long chain_index(const struct fsck_index *index, long n, uint32_t block)
+{
+    struct fsck_index key = { block, 0 };
+    const struct fsck_index *hit = bsearch(&key, index, n, sizeof(key), compare_index);
+    return hit != NULL ? hit->k : -1;
+}
+
+/**
+ * Do a bucket's entries and names fit in its block?
+ */
+static int bucket_fits(const csc452_directory_entry *bucket)
+{
+    size_t space = CSC452_BUCKET_SPACE(ck.bs);
+    return bucket->nFiles >= 0 && bucket->nameBytes <= space &&
+           (size_t) bucket->nFiles * sizeof(struct csc452_file_directory) <= space - bucket->nameBytes;
+}
+
+/**
+ * Copies entry i of a bucket, with its name, onto the end of d->files
+ * @return 0 on success, or -ENOMEM
+ */
+static int gather_entry(struct fsck_dir *d, long *cap, const csc452_directory_entry *bucket, long i)
+{
+    if (d->nFiles == *cap) {
+        long more = *cap == 0 ? 64 : *cap * 2;
+        struct fsck_entry *files = realloc(d->files, more * sizeof(struct fsck_entry));
+        if (files == NULL) {
+            return -ENOMEM;
+        }
+        d->files = files;
+        *cap = more;
+    }
+    const struct csc452_file_directory *f = &bucket->files[i];
+    struct fsck_entry *e = &d->files[d->nFiles++];
+    memset(e, 0, sizeof(*e));
+    e->fsize = f->fsize;
+    e->nStartBlock = f->nStartBlock;
+    e->type = f->type;
+    if (f->nameOffset >= ck.bs - bucket->nameBytes && f->nameOffset + f->nameLen <= ck.bs) {
+        e->nameLen = f->nameLen;
+        memcpy(e->name, (const char *) bucket + f->nameOffset, f->nameLen);
+    }
+    return 0;
+}
+
+//What each block of a directory's chain was found to be
+#define DIR_ORPHAN 0        //none of the below
+#define DIR_HEADER 1
+#define DIR_TABLE 2
+#define DIR_BUCKET 3
+
+/**
+ * Reads a directory's blocks, checks that its table and buckets fit
+ * together, and gathers the entries out of them. Anything wrong makes the
+ * directory dirty; buckets that can still be read are gathered even then.
+ * @return 0 on success, or negative errno
+ */
+static int load_dir(struct fsck_dir *d)
+{
+    struct fsck_chain *c = &ck.chains[d->chain];
+    long n = c->length;
+    long cap = 0;
+    char *data = malloc((size_t) n * ck.bs);
+    struct csc452_dir_header *head = (struct csc452_dir_header *) data;
+    struct fsck_index *index = malloc(n * sizeof(struct fsck_index));
+    char *role = calloc(n, 1);
+    long *slots = calloc(n, sizeof(long));  //how many table slots point at each block
+    long *first = calloc(n, sizeof(long));  //the first of them
+    uint32_t *table = NULL;
+    d->blocks = malloc(n * sizeof(uint32_t));
+    int res = data == NULL || index == NULL || role == NULL || slots == NULL || first == NULL ||
+              d->blocks == NULL ? -ENOMEM : 0;
+
+    uint32_t b = c->start;
+    for (long k = 0; res == 0 && k < n; k++, b = ck.fat[b]) {
+        d->blocks[d->nBlocks++] = b;
+        index[k].block = b;
+        index[k].k = k;
+        res = read_meta(data + (size_t) k * ck.bs, b);
+    }
+    if (res != 0) {
+        goto out;
+    }
+    qsort(index, n, sizeof(struct fsck_index), compare_index);
+
+    // The header says how big the table is and where it lives
+    uint32_t depth = head->depth;
+    long nSlots = depth <= dir_max_depth(ck.bs) ? 1L << depth : 0;
+    long nTable = nSlots > (long) CSC452_DIR_INLINE_SLOTS(ck.bs) ? nSlots / CSC452_DIR_SLOTS_PER_BLOCK(ck.bs) : 0;
+    int whole = nSlots > 0 && head->nTableBlocks == nTable;
+    role[0] = DIR_HEADER;
+    if (whole && nTable == 0) {
+        table = head->table;
+    } else if (whole && (table = malloc((size_t) nTable * ck.bs)) == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+    for (long t = 0; whole && t < nTable; t++) {
+        long k = chain_index(index, n, head->table[t]);
+        whole = k > 0 && role[k] == DIR_ORPHAN;
+        if (whole) {
+            role[k] = DIR_TABLE;
+            memcpy((char *) table + (size_t) t * ck.bs, data + (size_t) k * ck.bs, ck.bs);
+        }
+    }
+    if (!whole) {
+        problem("directory %s has a damaged header", dir_name(d));
+        d->dirty = 1;
+        nSlots = 0;
+    }
+
+    // Each bucket has the slots that agree with it in its low depth bits
+    for (long s = 0; s < nSlots; s++) {
+        long k = table[s] != 0 ? chain_index(index, n, table[s]) : -1;
+        if (table[s] == 0 && (nSlots > 1 || head->nEntries > 0)) {
+            problem("slot %ld of directory %s has no bucket", s, dir_name(d));
+            d->dirty = 1;
+        } else if (table[s] != 0 && (k <= 0 || role[k] == DIR_TABLE)) {
+            problem("slot %ld of directory %s points at block %u, not one of its buckets", s, dir_name(d), table[s]);
+            d->dirty = 1;
+        } else if (table[s] != 0) {
+            csc452_directory_entry *bucket = (csc452_directory_entry *) (data + (size_t) k * ck.bs);
+            uint32_t mask = bucket->depth < 32 ? (1u << bucket->depth) - 1 : ~0u;
+            if (slots[k]++ == 0) {
+                first[k] = s;
+                role[k] = DIR_BUCKET;
+            } else if ((s & mask) != (first[k] & mask)) {
+                role[k] = DIR_ORPHAN;
+            }
+        }
+    }
+
+    long total = 0;
+    for (long k = 1; res == 0 && k < n; k++) {
+        csc452_directory_entry *bucket = (csc452_directory_entry *) (data + (size_t) k * ck.bs);
+        if (role[k] == DIR_TABLE) {
+            continue;
+        }
+        if (!whole) {
+            // Without a table, whatever reads as a bucket is one
+            if (!bucket_fits(bucket)) {
+                continue;
+            }
+        } else if (slots[k] == 0) {
+            problem("block %u of directory %s is in its chain but not its table", d->blocks[k], dir_name(d));
+            d->dirty = 1;
+            if (!bucket_fits(bucket)) {
+                continue;
+            }
+        } else if (role[k] != DIR_BUCKET || bucket->depth > depth || slots[k] != 1L << (depth - bucket->depth)) {
+            problem("bucket %u of directory %s has depth %u but is in %ld slots of %ld", d->blocks[k], dir_name(d),
+                    bucket->depth, slots[k], nSlots);
+            d->dirty = 1;
+            role[k] = DIR_ORPHAN;
+        }
+        if (!bucket_fits(bucket)) {
+            problem("bucket %u of directory %s claims %d entries and %u bytes of names, more than fit",
+                    d->blocks[k], dir_name(d), bucket->nFiles, bucket->nameBytes);
+            size_t space = CSC452_BUCKET_SPACE(ck.bs);
+            bucket->nameBytes = bucket->nameBytes < space ? bucket->nameBytes : space;
+            long most = (space - bucket->nameBytes) / sizeof(struct csc452_file_directory);
+            bucket->nFiles = bucket->nFiles < 0 ? 0 : bucket->nFiles < most ? bucket->nFiles : most;
+            d->dirty = 1;
+        }
+
+        // A name in the wrong bucket is one lookups can't find, and one whose
+        // hash is wrong is never compared
+        uint32_t mask = role[k] == DIR_BUCKET ? (1u << bucket->depth) - 1 : 0;
+        for (long i = 0; res == 0 && i < bucket->nFiles; i++) {
+            if ((res = gather_entry(d, &cap, bucket, i)) != 0) {
+                break;
+            }
+            struct fsck_entry *f = &d->files[d->nFiles - 1];
+            uint32_t hash = name_hash(f->name, f->nameLen);
+            char name[PATH_MAX];
+            entry_name(name, sizeof(name), d, f);
+            if (valid_name(f) && (hash & mask) != ((uint32_t) first[k] & mask)) {
+                problem("%s is in the wrong bucket", name);
+                d->dirty = 1;
+            } else if (valid_name(f) && hash != bucket->files[i].hash) {
+                problem("%s has a damaged hash", name);
+                d->dirty = 1;
+            }
+        }
+        total += bucket->nFiles;
+    }
+    if (whole && head->nEntries != (uint64_t) total) {
+        problem("directory %s has %ld entries but its header says %llu", dir_name(d), total,
+                (unsigned long long) head->nEntries);
+        d->dirty = 1;
+    }
+
+out:
+    if (table != NULL && table != head->table) {
+        free(table);
+    }
+    free(first);
+    free(slots);
+    free(role);
+    free(index);
+    free(data);
+    return res;
+}
+
+/**
+ * Drops a directory's entries whose start block was set to 0
+ */
+static void compact_dir(long dir)
+{
+    struct fsck_dir *d = &ck.dirs[dir];
+    long n = 0;
+    for (long i = 0; i < d->nFiles; i++) {
+        if (d->files[i].nStartBlock != 0) {
+            d->files[n++] = d->files[i];
+        } else {
+            d->dirty = 1;
+        }
+    }
+    d->nFiles = n;
+}
+
+/**
+ * Checks a directory's entries, then claims the chain of each directory in
+ * it and queues it
+ * @return 0 on success, or negative errno
+ */
+static int check_dir(long dir)
+{
+    int res = load_dir(&ck.dirs[dir]);
+    if (res != 0) {
+        return res;
+    }
+
+    struct fsck_dir *d = &ck.dirs[dir];
+    char name[PATH_MAX];
+    for (long i = 0; i < d->nFiles; i++) {
+        struct fsck_entry *f = &d->files[i];
+        entry_name(name, sizeof(name), d, f);
+        if (!valid_name(f)) {
+            problem("entry %ld of directory %s has a damaged name", i, dir_name(d));
+            f->nStartBlock = 0;
+        } else if (f->type != CSC452_TYPE_FILE && f->type != CSC452_TYPE_DIR) {
+            problem("%s has unknown type %u", name, f->type);
+            f->nStartBlock = 0;
+        } else if (!data_block(f->nStartBlock)) {
+            problem("%s starts at block %u, outside the data blocks", name, f->nStartBlock);
+            f->nStartBlock = 0;
+        } else if (f->type == CSC452_TYPE_DIR && f->fsize != 0) {
+            problem("directory %s has size %llu", name, (unsigned long long) f->fsize);
+            f->fsize = 0;
+            d->dirty = 1;
+        }
+    }
+    compact_dir(dir);
+
+    // The first of each run of equal names stays
+    long n = d->nFiles;
+    long *order = malloc((n + 1) * sizeof(long));
+    if (order == NULL) {
+        return -ENOMEM;
+    }
+    for (long i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    sortFiles = d->files;
+    qsort(order, n, sizeof(long), compare_files);
+    for (long i = 1; i < n; i++) {
+        struct fsck_entry *f = &d->files[order[i]];
+        struct fsck_entry *prev = &d->files[order[i - 1]];
+        if (strcmp(f->name, prev->name) == 0) {
+            entry_name(name, sizeof(name), d, f);
+            problem("%s appears more than once", name);
+            f->nStartBlock = 0;
+        }
+    }
+    free(order);
+    compact_dir(dir);
+
+    // Queuing moves ck.dirs, so d is looked up again each time
+    for (long i = 0; res >= 0 && i < ck.dirs[dir].nFiles; i++) {
+        d = &ck.dirs[dir];
+        struct fsck_entry *f = &d->files[i];
+        if (f->type != CSC452_TYPE_DIR) {
+            continue;
+        }
+        entry_name(name, sizeof(name), d, f);
+        char *path = strdup(name);
+        res = path == NULL ? -ENOMEM : add_dir(path, f->nStartBlock);
+        if (res == 1) {
+            ck.dirs[dir].files[i].nStartBlock = 0;
+        }
+    }
+    compact_dir(dir);
+    return res < 0 ? res : 0;
+}
+
+/**
+ * Walks the tree from the root, breadth first, checking every directory
+ * @return 0 on success, or negative errno
+ */
+static int check_tree()
+{
+    char *path = strdup("");
+    int res = path == NULL ? -ENOMEM : add_dir(path, ck.sb.rootBlock);
+    for (long i = 0; res >= 0 && i < ck.nDirs; i++) {
+        res = check_dir(i);
+    }
+    return res < 0 ? res : 0;
+}
+
+static void *chain_worker(void *arg)
+{
+    (void) arg;
+    long i;
+    while ((i = __atomic_fetch_add(&ck.nextChain, 1, __ATOMIC_RELAXED)) < ck.nChains) {
+        walk_chain(&ck.chains[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Frees data blocks no chain reached in [from, to)
+ */
+static void *leak_worker(void *arg)
+{
+    struct fsck_work *w = arg;
+    for (long b = w->from; b < w->to; b++) {
+        if (ck.fat[b] != FAT_FREE && !(ck.claimed[b / 64] & ((uint64_t) 1 << (b % 64)))) {
+            set_fat(b, FAT_FREE);
+            w->count++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs fn on ck.nThreads threads, each with its share of [from, to)
+ * @return the sum of the workers' counts
+ */
+static long run_workers(void *(*fn)(void *), long from, long to)
+{
+    struct fsck_work work[FSCK_MAX_THREADS];
+    int n = ck.nThreads;
+    long per = (to - from + n - 1) / n;
+    for (int t = 0; t < n; t++) {
+        work[t].from = from + t * per < to ? from + t * per : to;
+        work[t].to = work[t].from + per < to ? work[t].from + per : to;
+        work[t].count = 0;
+        // Without a thread the share is done here, just more slowly
+        work[t].started = pthread_create(&work[t].thread, NULL, fn, &work[t]) == 0;
+        if (!work[t].started) {
+            fn(&work[t]);
+        }
+    }
+
+    long count = 0;
+    for (int t = 0; t < n; t++) {
+        if (work[t].started) {
+            pthread_join(work[t].thread, NULL);
+        }
+        count += work[t].count;
+    }
+    return count;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Finds the chain that claimed each shared block. Only run when some were
+ * found, so it can afford to walk everything again.
+ */
+static void find_owners(long nShared)
+{
+    uint32_t *blocks = malloc(nShared * sizeof(uint32_t));
+    long *owners = malloc(nShared * sizeof(long));
+    if (blocks == NULL || owners == NULL) {
+        free(owners);
+        free(blocks);
+        return;
+    }
+    long n = 0;
+    for (long i = 0; i < ck.nChains; i++) {
+        if (ck.chains[i].end == CHAIN_SHARED) {
+            blocks[n++] = ck.chains[i].link;
+        }
+    }
+    qsort(blocks, n, sizeof(uint32_t), compare_blocks);
+    for (long k = 0; k < n; k++) {
+        owners[k] = -1;
+    }
+
+    for (long i = 0; i < ck.nChains; i++) {
+        uint32_t block = ck.chains[i].start;
+        for (long k = 0; k < ck.chains[i].length; k++, block = ck.fat[block]) {
+            uint32_t *hit = bsearch(&block, blocks, n, sizeof(uint32_t), compare_blocks);
+            if (hit != NULL) {
+                owners[hit - blocks] = i;
+            }
+        }
+    }
+    for (long i = 0; i < ck.nChains; i++) {
+        if (ck.chains[i].end == CHAIN_SHARED) {
+            uint32_t *hit = bsearch(&ck.chains[i].link, blocks, n, sizeof(uint32_t), compare_blocks);
+            ck.chains[i].with = owners[hit - blocks];
+        }
+    }
+    free(owners);
+    free(blocks);
+}
+
+/**
+ * Writes a chain's path into buf
+ */
+static void chain_name(char *buf, size_t size, const struct fsck_chain *c)
+{
+    const struct fsck_dir *d = &ck.dirs[c->dir];
+    if (c->file < 0) {
+        snprintf(buf, size, "%s", dir_name(d));
+    } else {
+        entry_name(buf, size, d, &d->files[c->file]);
+    }
+}
+
+/**
+ * Walks every file's chain in parallel, then ends each broken chain at its
+ * last good block and fits file sizes to what their chains hold
+ * @return 0 on success, or negative errno
+ */
+static int check_files()
+{
+    // The directories' chains were walked already
+    long firstFile = ck.nChains;
+    for (long s = 0; s < ck.nDirs; s++) {
+        for (long i = 0; i < ck.dirs[s].nFiles; i++) {
+            struct fsck_entry *f = &ck.dirs[s].files[i];
+            if (f->type == CSC452_TYPE_FILE && add_chain(s, i, f->nStartBlock) < 0) {
+                return -ENOMEM;
+            }
+        }
+    }
+    ck.nFiles = ck.nChains - firstFile;
+
+    ck.nextChain = firstFile;
+    run_workers(chain_worker, 0, ck.nThreads);
+
+    long nShared = 0;
+    for (long i = 0; i < ck.nChains; i++) {
+        nShared += ck.chains[i].end == CHAIN_SHARED;
+    }
+    if (nShared > 0) {
+        find_owners(nShared);
+    }
+
+    // Report in directory order so the output doesn't depend on threads
+    for (long i = firstFile; i < ck.nChains; i++) {
+        struct fsck_chain *c = &ck.chains[i];
+        struct fsck_entry *f = &ck.dirs[c->dir].files[c->file];
+        char name[PATH_MAX], other[PATH_MAX] = "";
+        chain_name(name, sizeof(name), c);
+        if (c->with >= 0) {
+            chain_name(other, sizeof(other), &ck.chains[c->with]);
+        }
+
+        if (c->end == CHAIN_SHARED && c->length == 0) {
+            problem("file %s starts at block %u, which belongs to %s", name, c->link,
+                    other[0] ? other : "another chain");
+            continue;
+        }
+        end_chain("file", name, c, i, other);
+
+        // A file always has its first block, even when empty
+        uint64_t need = f->fsize == 0 ? 1 : (f->fsize + ck.bs - 1) / ck.bs;
+        if (need > (uint64_t) c->length) {
+            problem("file %s is %llu bytes but its chain holds %ld blocks", name,
+                    (unsigned long long) f->fsize, c->length);
+            f->fsize = (uint64_t) c->length * ck.bs;
+            ck.dirs[c->dir].dirty = 1;
+        } else if (need < (uint64_t) c->length) {
+            // Preallocation, or a write whose size never reached the entry
+            if (ck.verbose) {
+                printf("file %s has %llu blocks past its size\n", name,
+                       (unsigned long long) (c->length - need));
+            }
+            ck.unsized++;
+        }
+    }
+
+    // Entries whose first block belongs to someone else go last, as removing
+    // them moves the entries the names above came from
+    for (long i = firstFile; i < ck.nChains; i++) {
+        struct fsck_chain *c = &ck.chains[i];
+        if (c->end == CHAIN_SHARED && c->length == 0) {
+            ck.dirs[c->dir].files[c->file].nStartBlock = 0;
+            ck.nFiles--;
+        }
+    }
+    for (long s = 0; s < ck.nDirs; s++) {
+        compact_dir(s);
+    }
+    return 0;
+}
+
+/**
+ * Points a FAT entry somewhere, marking its block only if that changes it
+ */
+static void link_fat(long block, uint32_t val)
+{
+    if (ck.fat[block] != val) {
+        set_fat(block, val);
+    }
+}
+
+/**
+ * Bytes n entries of a directory from from on would take in a bucket
+ */
+static size_t run_bytes(const struct fsck_dir *d, long from, long n)
+{
+    size_t bytes = 0;
+    for (long i = from; i < from + n; i++) {
+        bytes += CSC452_ENTRY_BYTES(d->files[i].nameLen);
+    }
+    return bytes;
+}
+
+/**
+ * Splits a directory's entries into buckets the way the driver would have,
+ * each split taking one more bit of the hash, until every bucket fits. The
+ * entries are sorted so each bucket's are in one run.
+ * @param nBuckets set to how many buckets there are
+ * @return the buckets, or NULL if out of memory
+ */
+static struct fsck_bucket *plan_buckets(struct fsck_dir *d, long *nBuckets)
+{
+    long n = d->nFiles;
+    size_t space = CSC452_BUCKET_SPACE(ck.bs);
+    uint32_t maxDepth = dir_max_depth(ck.bs);
+    uint32_t *hashes = malloc((n + 1) * sizeof(uint32_t));
+    long *order = malloc((n + 1) * sizeof(long));
+    struct fsck_entry *files = malloc((n + 1) * sizeof(struct fsck_entry));
+    long cap = 16;
+    struct fsck_bucket *buckets = malloc(cap * sizeof(struct fsck_bucket));
+    if (hashes == NULL || order == NULL || files == NULL || buckets == NULL) {
+        free(buckets);
+        buckets = NULL;
+        goto out;
+    }
+    for (long i = 0; i < n; i++) {
+        hashes[i] = name_hash(d->files[i].name, d->files[i].nameLen);
+        order[i] = i;
+    }
+    sortHashes = hashes;
+    qsort(order, n, sizeof(long), compare_hashes);
+    for (long i = 0; i < n; i++) {
+        files[i] = d->files[order[i]];
+        order[i] = hashes[order[i]];
+    }
+    memcpy(d->files, files, n * sizeof(struct fsck_entry));
+
+    // The buckets still too full are split in place, with the upper half
+    // going on the end; order now holds the sorted hashes
+    long count = 0;
+    buckets[count++] = (struct fsck_bucket) { 0, 0, 0, n };
+    for (long j = 0; j < count; j++) {
+        while (run_bytes(d, buckets[j].from, buckets[j].n) > space && buckets[j].depth < maxDepth) {
+            if (count == cap) {
+                struct fsck_bucket *more = realloc(buckets, 2 * cap * sizeof(struct fsck_bucket));
+                if (more == NULL) {
+                    free(buckets);
+                    buckets = NULL;
+                    goto out;
+                }
+                buckets = more;
+                cap *= 2;
+            }
+            struct fsck_bucket *b = &buckets[j];
+            long split = b->from;
+            while (split < b->from + b->n && !((uint32_t) order[split] >> b->depth & 1)) {
+                split++;
+            }
+            buckets[count++] = (struct fsck_bucket) { b->pattern | 1u << b->depth, b->depth + 1, split,
+                                                       b->from + b->n - split };
+            b->n = split - b->from;
+            b->depth++;
+        }
+        struct fsck_bucket *b = &buckets[j];
+        if (run_bytes(d, b->from, b->n) > space) {
+            // Only names made to collide get here; the ones that don't fit go
+            problem("directory %s has %ld names sharing %u bits of hash, more than a bucket holds", dir_name(d),
+                    b->n, b->depth);
+            long fit = 0;
+            for (size_t bytes = 0; bytes + CSC452_ENTRY_BYTES(d->files[b->from + fit].nameLen) <= space; fit++) {
+                bytes += CSC452_ENTRY_BYTES(d->files[b->from + fit].nameLen);
+            }
+            for (long i = b->from + fit; i < b->from + b->n; i++) {
+                d->files[i].nStartBlock = 0;
+                ck.nFiles--;
+            }
+            b->n = fit;
+        }
+    }
+    *nBuckets = count;
+
+out:
+    free(files);
+    free(order);
+    free(hashes);
+    return buckets;
+}
+
+/**
+ * Lays a dirty directory's entries out again, in the fewest buckets the
+ * driver could have split them into: its chain is cut back or grown with
+ * free blocks to hold them, and d->image is filled in to be written over it.
+ * Runs after the leak pass, so a free block in the FAT really is free.
+ * @return 0 on success, or negative errno
+ */
+static int layout_dir(struct fsck_dir *d)
+{
+    long nBuckets = 0;
+    struct fsck_bucket *buckets = d->nFiles > 0 ? plan_buckets(d, &nBuckets) : NULL;
+    if (d->nFiles > 0 && buckets == NULL) {
+        return -ENOMEM;
+    }
+    uint32_t depth = 0;
+    long nEntries = 0;
+    for (long j = 0; j < nBuckets; j++) {
+        depth = buckets[j].depth > depth ? buckets[j].depth : depth;
+        nEntries += buckets[j].n;
+    }
+    long nSlots = 1L << depth;
+    long nTable = nSlots > (long) CSC452_DIR_INLINE_SLOTS(ck.bs) ? nSlots / CSC452_DIR_SLOTS_PER_BLOCK(ck.bs) : 0;
+    long need = 1 + nTable + nBuckets;
+
+    for (long k = need; k < d->nBlocks; k++) {
+        set_fat(d->blocks[k], FAT_FREE);
+    }
+    uint32_t *blocks = need > d->nBlocks ? realloc(d->blocks, need * sizeof(uint32_t)) : d->blocks;
+    d->image = calloc(need, ck.bs);
+    if (blocks == NULL || d->image == NULL) {
+        free(buckets);
+        return -ENOMEM;
+    }
+    d->blocks = blocks;
+    for (long k = d->nBlocks; k < need; k++) {
+        while (ck.nextFree < (long) ck.sb.fatStart && ck.fat[ck.nextFree] != FAT_FREE) {
+            ck.nextFree++;
+        }
+        if (ck.nextFree == (long) ck.sb.fatStart) {
+            free(buckets);
+            return -ENOSPC;
+        }
+        d->blocks[k] = ck.nextFree;
+        set_fat(ck.nextFree, FAT_EOC);
+    }
+    d->nBlocks = need;
+    for (long k = 0; k < need; k++) {
+        link_fat(d->blocks[k], k + 1 < need ? d->blocks[k + 1] : FAT_EOC);
+    }
+
+    // The first block, then the table's own blocks if it needs them, then the buckets
+    struct csc452_dir_header *head = (struct csc452_dir_header *) d->image;
+    head->depth = depth;
+    head->nTableBlocks = nTable;
+    head->nEntries = nEntries;
+    uint32_t *table = nTable > 0 ? (uint32_t *) (d->image + ck.bs) : head->table;
+    for (long t = 0; t < nTable; t++) {
+        head->table[t] = d->blocks[1 + t];
+    }
+    for (long j = 0; j < nBuckets; j++) {
+        long k = 1 + nTable + j;
+        csc452_directory_entry *bucket = (csc452_directory_entry *) (d->image + (size_t) k * ck.bs);
+        bucket->depth = buckets[j].depth;
+        for (long i = buckets[j].from; i < buckets[j].from + buckets[j].n; i++) {
+            struct csc452_file_directory *f = bucket_add(ck.bs, bucket, d->files[i].name, d->files[i].nameLen);
+            f->fsize = d->files[i].fsize;
+            f->nStartBlock = d->files[i].nStartBlock;
+            f->type = d->files[i].type;
+        }
+        for (long t = buckets[j].pattern; t < nSlots; t += 1L << buckets[j].depth) {
+            table[t] = d->blocks[k];
+        }
+    }
+    free(buckets);
+    return 0;
+}
+
+/**
+ * Writes the blocks a directory was laid out in
+ * @return 0 on success, or negative errno
+ */
+static int write_dir(const struct fsck_dir *d)
+{
+    int res = 0;
+    for (long k = 0; res == 0 && k < d->nBlocks; k++) {
+        res = write_all(d->image + (size_t) k * ck.bs, ck.bs, (off_t) d->blocks[k] * ck.bs);
+    }
+    return res;
+}
+
+/**
+ * Writes every block the check changed, or that the journal would have
+ * replayed, and then empties the journal so a later mount doesn't replay
+ * the old transaction over the repairs
+ * @return 0 on success, or negative errno
+ */
+static int write_back()
+{
+    int res = 0;
+    for (uint32_t i = 0; res == 0 && ck.journal != NULL && i < ck.journal->nImages; i++) {
+        uint64_t t = ck.journal->targets[i];
+        if (t >= ck.sb.fatStart) {
+            ck.fatDirty[t - ck.sb.fatStart] = 1;
+        } else {
+            res = write_all(ck.journalImages + (size_t) i * ck.bs, ck.bs, (off_t) t * ck.bs);
+        }
+    }
+
+    // Blocks of directories that were dropped stay as they are
+    for (long s = 0; res == 0 && s < ck.nDirs; s++) {
+        if (ck.dirs[s].dirty) {
+            res = write_dir(&ck.dirs[s]);
+        }
+    }
+    for (long i = 0; res == 0 && i < (long) ck.sb.fatBlocks; i++) {
+        long j = i;
+        while (j < (long) ck.sb.fatBlocks && ck.fatDirty[j]) {
+            j++;
+        }
+        if (j > i) {
+            res = write_all((char *) ck.fat + (size_t) i * ck.bs, (size_t) (j - i) * ck.bs,
+                            (off_t) (ck.sb.fatStart + i) * ck.bs);
+        }
+        i = j;
+    }
+    if (res == 0 && fsync(ck.fd) != 0) {
+        res = -errno;
+    }
+
+    if (res == 0 && ck.journal != NULL) {
+        char *zero = calloc(1, ck.bs);
+        res = zero == NULL ? -ENOMEM : write_all(zero, ck.bs, (off_t) ck.sb.journalStart * ck.bs);
+        if (res == 0 && fsync(ck.fd) != 0) {
+            res = -errno;
+        }
+        free(zero);
+    }
+    return res;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: csc452fsck [-n | -y] [-v] [-j threads] [image]\n");
+    exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ck.nThreads = cpus < 1 ? 1 : cpus > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : cpus;
+    while ((opt = getopt(argc, argv, "nyvj:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ck.repair = 0;
+                break;
+            case 'y':
+                ck.repair = 1;
+                break;
+            case 'v':
+                ck.verbose = 1;
+                break;
+            case 'j':
+                ck.nThreads = atoi(optarg);
+                if (ck.nThreads < 1 || ck.nThreads > FSCK_MAX_THREADS) {
+                    fprintf(stderr, "csc452fsck: -j takes 1 to %d threads\n", FSCK_MAX_THREADS);
+                    return FSCK_ERROR;
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind + 1 < argc) {
+        usage();
+    }
+    ck.image = optind < argc ? argv[optind] : ".disk";
+
+    struct stat st;
+    ck.fd = open(ck.image, ck.repair ? O_RDWR : O_RDONLY);
+    if (ck.fd < 0 || fstat(ck.fd, &st) != 0) {
+        fprintf(stderr, "csc452fsck: cannot open %s: %s\n", ck.image, strerror(errno));
+        return FSCK_ERROR;
+    }
+    if (read_all(&ck.sb, sizeof(ck.sb), 0) != 0 || !check_superblock(&ck.sb, st.st_size)) {
+        fprintf(stderr, "csc452fsck: %s has no usable version %d superblock\n", ck.image, CSC452_VERSION);
+        return FSCK_ERROR;
+    }
+    ck.bs = ck.sb.blockSize;
+    ck.perFatBlock = CSC452_FAT_PER_BLOCK(ck.bs);
+    ck.dataStart = ck.sb.rootBlock + 1;
+    if (ck.sb.features & CSC452_FEATURE_JOURNAL) {
+        ck.dataStart = ck.sb.journalStart + ck.sb.journalBlocks;
+    }
+
+    int res = load_journal();
+    if (res == 0) {
+        res = load_fat();
+    }
+    if (res == 0) {
+        check_layout();
+        res = check_tree();
+    }
+    if (res == 0) {
+        res = check_files();
+    }
+    if (res != 0) {
+        fprintf(stderr, "csc452fsck: cannot check %s: %s\n", ck.image, strerror(-res));
+        return FSCK_ERROR;
+    }
+
+    long leaked = run_workers(leak_worker, ck.dataStart, ck.sb.fatStart);
+    if (leaked > 0) {
+        problem("%ld blocks are allocated but belong to no file or directory", leaked);
+    }
+    ck.nextFree = ck.dataStart;
+    for (long s = 0; res == 0 && s < ck.nDirs; s++) {
+        if (ck.dirs[s].dirty) {
+            res = layout_dir(&ck.dirs[s]);
+        }
+    }
+    if (res != 0) {
+        fprintf(stderr, "csc452fsck: cannot lay out directories of %s: %s\n", ck.image, strerror(-res));
+        return FSCK_ERROR;
+    }
+
+    if (ck.repair && (ck.problems > 0 || ck.journal != NULL) && (res = write_back()) != 0) {
+        fprintf(stderr, "csc452fsck: cannot write %s: %s\n", ck.image, strerror(-res));
+        return FSCK_ERROR;
+    }
+
+    long used = 0;
+    for (long b = ck.dataStart; b < (long) ck.sb.fatStart; b++) {
+        used += ck.fat[b] != FAT_FREE;
+    }
+    printf("%s: %ld directories, %ld files, %ld of %ld data blocks in use\n", ck.image,
+           ck.nDirs - 1, ck.nFiles, used, (long) ck.sb.fatStart - ck.dataStart);
+    if (ck.unsized > 0) {
+        printf("%s: %ld files have blocks past their size\n", ck.image, ck.unsized);
+    }
+    if (ck.problems > 0) {
+        printf("%s: %ld problems %s\n", ck.image, ck.problems, ck.repair ? "fixed" : "found");
+    }
+    close(ck.fd);
+    return ck.problems == 0 ? FSCK_OK : ck.repair ? FSCK_FIXED : FSCK_UNFIXED;
+}
@@ -1,761 +1,4509 @@
-/*
-	FUSE: Filesystem in Userspace
-
-
-	gcc -Wall `pkg-config fuse --cflags --libs` csc452fuse.c -o csc452
-
-
-*/
-
-#define    FUSE_USE_VERSION 26
-
-#include <fuse.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <dirent.h>
-#include <ctype.h>
-
-//size of a disk block
-#define    BLOCK_SIZE 512
-
-//we'll use 8.3 filenames
-#define    MAX_FILENAME 8
-#define    MAX_EXTENSION 3
-
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
-
-//The attribute packed means to not align these things
-struct csc452_directory_entry {
-    int nFiles;    //How many files are in this directory.
-    //Needs to be less than MAX_FILES_IN_DIR
-
-    struct csc452_file_directory {
-        char fname[MAX_FILENAME + 1];    //filename (plus space for nul)
-        char fext[MAX_EXTENSION + 1];    //extension (plus space for nul)
-        size_t fsize;                    //file size
-        long nStartBlock;                //where the first block is on disk
-    } __attribute__((packed)) files[MAX_FILES_IN_DIR];    //There is an array of these
-
-    //This is some space to get this to be exactly the size of the disk block.
-    //Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct csc452_file_directory) - sizeof(int)];
-};
-
-typedef struct csc452_root_directory csc452_root_directory;
-
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
-
-struct csc452_root_directory {
-    int nDirectories;    //How many subdirectories are in the root
-    //Needs to be less than MAX_DIRS_IN_ROOT
-    struct csc452_directory {
-        char dname[MAX_FILENAME + 1];    //directory name (plus space for nul)
-        long nStartBlock;                //where the directory block is on disk
-    } __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];    //There is an array of these
-
-    //This is some space to get this to be exactly the size of the disk block.
-    //Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct csc452_directory) - sizeof(int)];
-};
-
-typedef struct csc452_directory_entry csc452_directory_entry;
-
-//How much data can one block hold?
-#define    MAX_DATA_IN_BLOCK (BLOCK_SIZE)
-
-struct csc452_disk_block {
-    //All of the space in the block can be used for actual data
-    //storage.
-    char data[MAX_DATA_IN_BLOCK];
-};
-
-typedef struct csc452_disk_block csc452_disk_block;
-
-#define FAT_BLOCK_COUNT 40
-#define FAT_BLOCK_SIZE (FAT_BLOCK_COUNT * BLOCK_SIZE)
-#define FAT_ENTRIES ((FAT_BLOCK_SIZE / sizeof(short)) - FAT_BLOCK_COUNT)
-
-/**
- * opens the disk and reads in the root
- */
-void open_root(csc452_root_directory *root)
-{
-    FILE *file = fopen(".disk", "r+b");
-    if (file != NULL) {
-        if (fread(root, sizeof(csc452_root_directory), 1, file) == (size_t) 0) {
-            printf("File could not be read\n");
-            return;
-        }
-        fclose(file);
-    }
-}
-
-/**
- * takes in a directory name and will search the disk
- * for the directory, fill the entry parameter and
- * return the start block of the directory
- * @param directory
- * @param directoryName
- * @return the start block of the directory
- */
-long get_directory(csc452_directory_entry *directory, char *directoryName)
-{
-    long startBlock = 0;
-    csc452_root_directory root;
-    open_root(&root);
-
-    // Iterate and find that directory in the root
-    for (int i = 0; i < root.nDirectories; i++) {
-        if (strcmp(directoryName, root.directories[i].dname) == 0) {
-            startBlock = root.directories[i].nStartBlock;
-            break;
-        }
-    }
-
-    FILE *file = fopen(".disk", "r");
-
-    // Get the directory from the disk
-    if (file != NULL) {
-        fseek(file, startBlock, SEEK_SET);
-        fread(directory, sizeof(csc452_directory_entry), 1, file);
-        fclose(file);
-    }
-    return startBlock;
-}
-
-int get_file(char *directory, char *file, char *extension)
-{
-    csc452_directory_entry entry;
-    get_directory(&entry, directory);
-
-    // Iterate and find the start block of the file
-    for (int i = 0; i < entry.nFiles; i++) {
-        if (strcmp(entry.files[i].fname, file) == 0 &&
-            strcmp(entry.files[i].fext, extension) == 0) {
-            return entry.files[i].nStartBlock;
-        }
-    }
-    return -1;
-}
-
-int check_directory(char *directory)
-{
-    int flag = 0;
-    csc452_root_directory root;
-    open_root(&root);
-
-    for (int i = 0; i < root.nDirectories; i++) {
-        if (strcmp(directory, root.directories[i].dname) == 0) {
-            flag = 1;
-            break;
-        }
-    }
-
-    return flag;
-}
-
-/**
- * Checks if a file exists in a directory
- */
-int check_file_exists(char *directory, char *file, char *extension)
-{
-    int flag = -1;
-
-    // check if the directory exists
-    if (check_directory(directory) != 0) {
-        csc452_directory_entry entry;
-        get_directory(&entry, directory);
-        // loop over the entires and check if the file given is in it
-        for (int i = 0; i < entry.nFiles; i++) {
-            if (strcmp(entry.files[i].fname, file) == 0 && strcmp(extension, entry.files[i].fext) == 0) {
-                flag = entry.files[i].fsize;
-                break;
-            }
-        }
-    }
-    return flag;
-}
-
-
-/**
- * Update a file size
- */
-void update_file_size(size_t newSize, char *directory, char *file, char *extension)
-{
-    csc452_directory_entry entry;
-    long startBlock = get_directory(&entry, directory);
-
-    // loop through and find the correct entry
-    for (int i = 0; i < entry.nFiles; i++) {
-        if (strcmp(entry.files[i].fname, file) == 0 && strcmp(extension, entry.files[i].fext) == 0) {
-            //Update the entry file size and write it back to disk
-            entry.files[i].fsize = newSize;
-            FILE *file = fopen(".disk", "r+b");
-            fseek(file, startBlock, SEEK_SET);
-            fwrite(&entry, BLOCK_SIZE, 1, file);
-            fclose(file);
-            break;
-        }
-    }
-}
-
-/**
- * Extract directory, file and extension from given path
- */
-int split_path(const char *path, char *directory, char *file, char *extension)
-{
-    int readIn = sscanf(path, "/%[^/]/%[^.].%s", directory, file, extension);
-    directory[MAX_FILENAME] = '\0';
-    file[MAX_FILENAME] = '\0';
-    extension[MAX_EXTENSION] = '\0';
-
-    int file_type = -1;
-    file_type += readIn;
-
-    if (file_type == 1) {
-        extension = "\0";
-    }
-
-    return file_type;
-}
-
-/**
- * Opens the disk and get the next available fat block
- */
-long get_fat_block()
-{
-    FILE *disk = fopen(".disk", "r+b");
-    short fat_val;
-    fseek(disk, ((-FAT_BLOCK_SIZE) + sizeof(short)), SEEK_END);
-    fread(&fat_val, sizeof(short), 1, disk);
-    // Find next available fat block
-    for (int i = 1; i < FAT_ENTRIES; i++) {
-        if (fat_val == 0) {
-            return i * 512;
-        }
-        fread(&fat_val, sizeof(short), 1, disk);
-    }
-    fclose(disk);
-    return -1;
-}
-
-
-/**
- * takes in a value and block address. It sets that address' value to value
- */
-void set_fat_block(long blockAddr, short val)
-{
-    FILE *disk = fopen(".disk", "r+b");
-    short fat_entry = blockAddr / BLOCK_SIZE;
-    fseek(disk, (-FAT_BLOCK_SIZE + ((sizeof(short) * fat_entry))), SEEK_END);
-    fwrite(&val, sizeof(short), 1, disk);
-    fclose(disk);
-}
-
-/**
- * Calculate the value at a specified block address
- */
-short get_fat_val(long blockAddr)
-{
-    FILE *disk = fopen(".disk", "r+b");
-    short fat_entry = blockAddr / BLOCK_SIZE;
-    short res = 0;
-    fseek(disk, (-FAT_BLOCK_SIZE + ((sizeof(short) * fat_entry))), SEEK_END);
-    fread(&res, sizeof(short), 1, disk);
-    fclose(disk);
-    return res;
-}
-
-
-/**
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not.
- *
- * man -s 2 stat will show the fields of a stat structure
- */
-static int csc452_getattr(const char *path, struct stat *stbuf)
-{
-    int res = 0;
-    // Parse path
-    char directory[MAX_FILENAME + 1] = "";
-    char file[MAX_FILENAME + 1] = "";
-    char extension[MAX_EXTENSION + 1] = "";
-    int fsize = -1;
-
-    int file_type = split_path(path, directory, file, extension);
-    // Path is root
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    }
-    // Path is directory
-    else if (file_type == 0 && check_directory(directory) == 1) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    }
-    // Path is file
-    else if (file_type >= 1 && (fsize = check_file_exists(directory, file, extension)) != -1) {
-        stbuf->st_mode = S_IFREG | 0666;
-        stbuf->st_nlink = 2;
-        stbuf->st_size = fsize;
-    } else {
-        //Else return that path doesn't exist
-        res = -ENOENT;
-    }
-    return res;
-}
-
-/**
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int csc452_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                          off_t offset, struct fuse_file_info *fi)
-{
-    //Since we're building with -Wall (all warnings reported) we need
-    //to "use" every parameter, so let's just cast them to void to
-    //satisfy the compiler
-    (void) offset;
-    (void) fi;
-
-    // Parse path
-    char directory[MAX_FILENAME + 1];
-    char file[MAX_FILENAME + 1];
-    char extension[MAX_EXTENSION + 1];
-    int fileOrDir = split_path(path, directory, file, extension);
-
-    //A directory holds two entries, one that represents itself (.)
-    //and one that represents the directory above us (..)
-    if (strcmp(path, "/") == 0) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-
-        csc452_root_directory root;
-        open_root(&root);
-
-        // Add all directories in the root
-        for (int i = 0; i < root.nDirectories; i++) {
-            if (strcmp(root.directories[i].dname, "\0") != 0) {
-                filler(buf, root.directories[i].dname, NULL, 0);
-            }
-        }
-    }
-    // Path is directory
-    else if (fileOrDir == 0 && check_directory(directory) == 1) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-
-        csc452_directory_entry entry;
-        get_directory(&entry, directory);
-
-        // Add all the files in the directory
-        for (int i = 0; i < entry.nFiles; i++) {
-            if (strcmp(entry.files[i].fname, "\0") != 0) {
-                // No extention
-                if (strcmp(entry.files[i].fext, "\0") == 0) {
-                    filler(buf, entry.files[i].fname, NULL, 0);
-                }
-                // With extention
-                else {
-                    char fullFileName[MAX_FILENAME + MAX_EXTENSION + 2];
-                    strcpy(fullFileName, entry.files[i].fname);
-                    strcat(fullFileName, ".");
-                    strcat(fullFileName, entry.files[i].fext);
-                    filler(buf, fullFileName, NULL, 0);
-                }
-            }
-        }
-    } else {
-        return -ENOENT;
-    }
-    return 0;
-}
-
-/**
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int csc452_mkdir(const char *path, mode_t mode)
-{
-    (void) path;
-    (void) mode;
-
-    // Parse path
-    char directory[MAX_FILENAME + 1] = "";
-    char file[MAX_FILENAME + 1] = "";
-    char extension[MAX_EXTENSION + 1] = "";
-    int res = 0;
-    int type = split_path(path, directory, file, extension);
-
-    // Error checks
-    if (strlen(directory) > MAX_FILENAME) {
-        return -ENAMETOOLONG;
-    } else if (type != 0) {
-        return -EPERM;
-    } else if (check_directory(directory) != 0) {
-        return -EEXIST;
-    }
-
-    csc452_root_directory root;
-    open_root(&root);
-
-    if (root.nDirectories >= MAX_DIRS_IN_ROOT) {
-        printf("The directory could not be created, you have reached the maximum directories allowed in the root.\n");
-        return -1;
-    }
-
-    root.nDirectories += 1;
-    long blockPos = get_fat_block();
-
-    // Update FAT table to mark the directory
-    set_fat_block(blockPos, -1);
-    // Create directory entry
-    csc452_directory_entry newDir;
-    newDir.nFiles = 0;
-    FILE *disk = fopen(".disk", "r+b");
-    strcpy(root.directories[root.nDirectories - 1].dname, directory);
-    root.directories[root.nDirectories - 1].nStartBlock = blockPos;
-
-    // Update disk
-    fseek(disk, 0, SEEK_SET);
-    fwrite(&root, BLOCK_SIZE, 1, disk);
-    fseek(disk, blockPos, SEEK_SET);
-    fwrite(&newDir, BLOCK_SIZE, 1, disk);
-    fclose(disk);
-
-    return res;
-}
-
-/**
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
- * Note that the mknod shell command is not the one to test this.
- * mknod at the shell is used to create "special" files and we are
- * only supporting regular files.
- *
- */
-static int csc452_mknod(const char *path, mode_t mode, dev_t dev)
-{
-    (void) path;
-    (void) mode;
-    (void) dev;
-
-    char directory[MAX_FILENAME + 1] = "";
-    char file[MAX_FILENAME + 1] = "";
-    char extension[MAX_EXTENSION + 1] = "";
-    int res = 0;
-    split_path(path, directory, file, extension);
-
-    // Check if the path correct
-    if (strcmp(path, "/") == 0) {
-        res = -EPERM;
-    } else if (strlen(file) > MAX_FILENAME) {
-        res = -ENAMETOOLONG;
-    } else if (check_file_exists(directory, file, extension) >= 0) {
-        res = -EEXIST;
-    } else {
-        csc452_directory_entry entry;
-        long directoryStart = get_directory(&entry, directory);
-        long blockPos = get_fat_block();
-        entry.nFiles += 1;
-
-        //Update FAT table to mark the file location
-        set_fat_block(blockPos, -1);
-        //Update directory entry
-        entry.files[entry.nFiles - 1].nStartBlock = blockPos;
-        strcpy(entry.files[entry.nFiles - 1].fname, file);
-        if (strcmp(extension, "\0") == 0) {
-            strcpy(entry.files[entry.nFiles - 1].fext, "\0");
-        } else {
-            strcpy(entry.files[entry.nFiles - 1].fext, extension);
-        }
-
-        // Set the file size
-        entry.files[entry.nFiles - 1].fsize = 0;
-
-        //Update disk
-        FILE *file = fopen(".disk", "r+b");
-        fseek(file, directoryStart, SEEK_SET);
-        fwrite(&entry, BLOCK_SIZE, 1, file);
-        fclose(file);
-    }
-
-    // return result
-    return res;
-}
-
-/**
- * Read size bytes from file into buf starting from offset
- *
- */
-static int csc452_read(const char *path, char *buf, size_t size, off_t offset,
-                       struct fuse_file_info *fi)
-{
-    //check to make sure path exists
-    //check that size is > 0
-    //check that offset is <= to the file size
-    //read in data
-    //return success, or error
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
-
-    // Parse path
-    char directory[MAX_FILENAME + 1] = "";
-    char file[MAX_FILENAME + 1] = "";
-    char extension[MAX_EXTENSION + 1] = "";
-
-    split_path(path, directory, file, extension);
-
-    // check if directory and file exist
-    if (check_directory(directory) == 0 || check_file_exists(directory, file, extension) <= 0) {
-        return -ENOENT;
-    }
-
-    // if offset is > sie return error
-    if (offset > size) {
-        return -EFBIG;
-    }
-
-    int fsize = check_file_exists(directory, file, extension);
-    short fatIndex = get_file(directory, file, extension) / BLOCK_SIZE;
-
-    FILE *disk = fopen(".disk", "r");
-
-    // loop over all blocks that contain the file and read it to buffer
-    for (int i = 0; i < ((fsize / BLOCK_SIZE)) + 1; i++) {
-        fseek(disk, BLOCK_SIZE * fatIndex, SEEK_SET);
-        fread(buf + (i * BLOCK_SIZE), BLOCK_SIZE, 1, disk);
-        fatIndex = get_fat_val(fatIndex);
-    }
-
-    // close disk
-    fclose(disk);
-
-    return size;
-}
-
-/**
- * Write size bytes from buf into file starting from offset
- *
- */
-static int csc452_write(const char *path, const char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *fi)
-{
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
-
-    // Parse path
-    char directory[MAX_FILENAME + 1];
-    char file[MAX_FILENAME + 1];
-    char extension[MAX_EXTENSION + 1];
-    split_path(path, directory, file, extension);
-    size_t res = size;
-    size_t fileSize = 0;
-
-    // Error check
-    if (offset > (fileSize = check_file_exists(directory, file, extension))) {
-        return -EFBIG;
-    }
-        // Check if the file exists
-    else if (check_directory(directory) == 1) {
-        long fileStart = get_file(directory, file, extension);
-        long fileStartIndex = fileStart / BLOCK_SIZE;
-        int offsetIndex = offset / BLOCK_SIZE;
-        int beginWriting = offset % BLOCK_SIZE;
-
-        // Update the file size 
-        update_file_size((fileSize + res), directory, file, extension);
-
-        FILE *disk = fopen(".disk", "r+b");
-        csc452_disk_block block;
-        // Walk to the block where we want to modify
-        for (int i = 0; i < offsetIndex; i++) {
-            if (get_fat_val(fileStartIndex * BLOCK_SIZE) != -1) {
-                fileStartIndex = get_fat_val(fileStartIndex * BLOCK_SIZE);
-            }
-        }
-
-        // Grab that block
-        fseek(disk, (fileStartIndex * BLOCK_SIZE), SEEK_SET);
-        fread(&block, sizeof(csc452_disk_block), 1, disk);
-
-        // When the size is smaller than the block        
-        if ((strlen(block.data) + size) <= BLOCK_SIZE) {
-            // Need to add beginWriting to handle adding offset
-            strncpy(block.data + beginWriting, buf, size);
-            fseek(disk, fileStartIndex * BLOCK_SIZE, SEEK_SET);
-            fwrite(&block, sizeof(csc452_disk_block), 1, disk);
-        } else {
-            // Need to add beginWriting to handle adding offset
-            strncpy(block.data + beginWriting, buf, (BLOCK_SIZE - beginWriting));
-            fseek(disk, fileStartIndex * BLOCK_SIZE, SEEK_SET);
-            fwrite(&block, sizeof(csc452_disk_block), 1, disk);
-            // Increment the buffer
-            buf += (BLOCK_SIZE) - beginWriting;
-            size = size - (BLOCK_SIZE - beginWriting);
-
-            // As long as there are available blocks to use
-            while (get_fat_val(fileStartIndex * BLOCK_SIZE) != -1) {
-                fileStartIndex = get_fat_val(fileStartIndex * BLOCK_SIZE);
-                fseek(disk, fileStartIndex * BLOCK_SIZE, SEEK_SET);
-                // Need to write a block amount of data
-                if (size > BLOCK_SIZE) {
-                    strncpy(block.data, buf, BLOCK_SIZE);
-                    fwrite(&block, sizeof(csc452_disk_block), 1, disk);
-                    buf += BLOCK_SIZE;
-                    size = size - BLOCK_SIZE;
-                }
-                    // Need to write less than a block of data
-                else {
-                    strncpy(block.data, buf, size);
-                    fwrite(&block, sizeof(csc452_disk_block), 1, disk);
-                    size = 0;
-                }
-            }
-            // More to write and need more blocks
-            long prevBlock = 0;
-            while (size > 0) {
-                // Need to write a block amount of data
-                if (size > BLOCK_SIZE) {
-                    strncpy(block.data, buf, BLOCK_SIZE);
-                    long nextBlock = get_fat_block();
-                    if (prevBlock != 0) {
-                        set_fat_block(prevBlock, (nextBlock / BLOCK_SIZE));
-                    }
-                    prevBlock = nextBlock;
-                    fseek(disk, nextBlock, SEEK_SET);
-                    fwrite(&block, sizeof(csc452_disk_block), 1, disk);
-                    set_fat_block(nextBlock, -1);
-                    buf += BLOCK_SIZE;
-                    size = size - BLOCK_SIZE;
-                }
-                    // Need to write less than a block of data
-                else {
-                    strncpy(block.data, buf, size);
-                    long nextBlock = get_fat_block();
-                    if (prevBlock != 0) {
-                        set_fat_block(prevBlock, (nextBlock / BLOCK_SIZE));
-                    }
-                    prevBlock = nextBlock;
-                    fseek(disk, nextBlock, SEEK_SET);
-                    fwrite(&block, sizeof(csc452_disk_block), 1, disk);
-                    set_fat_block(nextBlock, -1);
-                    buf += BLOCK_SIZE;
-                    break;
-                }
-            }
-        }
-    }
-
-    return res;
-}
-
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
-
-/**
- * Removes a directory (must be empty)
- *
- */
-static int csc452_rmdir(const char *path)
-{
-    (void) path;
-
-    return 0;
-}
-
-/**
- * Removes a file.
- *
- */
-static int csc452_unlink(const char *path)
-{
-    (void) path;
-    return 0;
-}
-
-/**
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
- */
-static int csc452_truncate(const char *path, off_t size)
-{
-    (void) path;
-    (void) size;
-
-    return 0;
-}
-
-/**
- * Called when we open a file
- *
- */
-static int csc452_open(const char *path, struct fuse_file_info *fi)
-{
-    (void) path;
-    (void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
-
-    //It's not really necessary for this project to anything in open
-
-    /* We're not going to worry about permissions for this project, but
-	   if we were and we don't have them to the file we should return an error
-
-        return -EACCES;
-    */
-
-    return 0; //success!
-}
-
-/**
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
- */
-static int csc452_flush(const char *path, struct fuse_file_info *fi)
-{
-    (void) path;
-    (void) fi;
-
-    return 0; //success!
-}
-
-
-//register our new functions as the implementations of the syscalls
-static struct fuse_operations csc452_oper = {
-        .getattr    = csc452_getattr,
-        .readdir    = csc452_readdir,
-        .mkdir    = csc452_mkdir,
-        .read    = csc452_read,
-        .write    = csc452_write,
-        .mknod    = csc452_mknod,
-        .truncate    = csc452_truncate,
-        .flush    = csc452_flush,
-        .open    = csc452_open,
-        .unlink    = csc452_unlink,
-        .rmdir    = csc452_rmdir
-};
-
-//Don't change this.
-int main(int argc, char *argv[])
-{
-    return fuse_main(argc, argv, &csc452_oper, NULL);
-}
+/*
+	FUSE: Filesystem in Userspace
+
+
+	gcc -Wall `pkg-config fuse --cflags --libs` csc452fuse.c -o csc452
+
+	With liburing installed, -o uring can move block I/O onto io_uring:
+
+	gcc -Wall -DHAVE_LIBURING `pkg-config fuse --cflags --libs` csc452fuse.c -o csc452 -luring
+
+	The image is .disk in the current directory unless -o image=PATH names
+	another, so one process per image can serve several mounts at once:
+
+	./csc452 -o image=/data1/a.img /mnt/a
+	./csc452 -o image=/data2/b.img /mnt/b
+
+	Every change to a mounted image goes through the kernel, so it may keep
+	what it has cached: attributes and names for -o attr_timeout=S and
+	-o entry_timeout=S seconds (a minute unless given), and file pages
+	from one open to the next.
+
+*/
+
+#define    FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "csc452fs.h"
+
+//memory for the block cache, unless -o cache=N gives a count of blocks
+#define    DEFAULT_CACHE_BYTES (4 << 20)
+#define    MIN_CACHE_BLOCKS 16
+
+//runs of whole blocks at least this long are written around the cache
+#define    DIRECT_WRITE_BYTES (64 << 10)
+
+//truncate grows a file with zeros this many bytes at a time
+#define    ZERO_BYTES (1 << 20)
+
+//read-ahead starts with this window once reads look sequential and doubles
+//up to the maximum (capped at a quarter of the cache) while they stay so
+#define    RA_MIN_BYTES (64 << 10)
+#define    RA_MAX_BYTES (1 << 20)
+#define    RA_THREADS 2
+#define    RA_QUEUE 64
+
+//submission queue entries in each thread's io_uring
+#define    URING_ENTRIES 64
+
+//seconds the kernel keeps attributes and names, unless -o says otherwise
+#define    DEFAULT_ATTR_TIMEOUT 60.0
+#define    DEFAULT_ENTRY_TIMEOUT 60.0
+
+//largest write the kernel sends in one request
+#define    MAX_WRITE_BYTES (128 << 10)
+
+//How much data can one block hold?
+#define    MAX_DATA_IN_BLOCK (fs->blockSize)
+
+//How many FAT entries fit in one block of the FAT region?
+#define FAT_ENTRIES_PER_BLOCK CSC452_FAT_PER_BLOCK(fs->blockSize)
+
+//How a FAT block differs from disk. Blocks that only took allocations may
+//be committed ahead of the directories, which can leak blocks at worst;
+//one that cut a chain short goes with them.
+#define FAT_DIRTY 1
+#define FAT_DIRTY_CUT 2
+
+//Buckets in the table of cached directories (power of two)
+#define DIR_BUCKETS 1024
+
+//readdir offsets: 1 and 2 come after "." and "..", and an entry's position
+//is READDIR_FIRST plus its name's hash_order, shifted up to make room to
+//number the names that share a hash
+#define READDIR_FIRST 3
+#define READDIR_SAME_BITS 8
+
+/**
+ * A bucket of a cached directory, read in the first time a name hashes to
+ * it
+ */
+struct csc452_dir_bucket {
+    long block;
+    csc452_directory_entry *data;
+    int dirty;                              //changed since last written
+    struct csc452_dir_bucket *next;         //next of the directory's buckets
+    struct csc452_dir_bucket *dirtyNext;    //next on the directory's dirty list
+};
+
+/**
+ * A directory cached in memory. Its first block is read on first use, and
+ * table blocks and buckets as lookups reach them, so a lookup in a cold
+ * directory of any size costs at most three block reads. Cached
+ * directories are found by start block in dirTable and stay cached until
+ * rmdir or unmount.
+ */
+struct csc452_dir_cache {
+    pthread_rwlock_t lock;  //guards everything below but the links, and the blocks on disk
+    pthread_mutex_t loadLock;   //readers bringing buckets in
+    int loaded;
+    long startBlock;
+    struct csc452_dir_header *head;     //the first block
+    uint32_t *table;            //bucket blocks by slot, in head or tableData
+    char *tableData;            //the table's own blocks, once it has them
+    unsigned char *tableLoaded; //table blocks read in, under loadLock
+    unsigned char *tableDirty;  //table blocks changed since last written
+    int headDirty;
+    struct csc452_dir_bucket **slots;   //bucket read in for each slot, or NULL
+    struct csc452_dir_bucket *buckets;  //every bucket read in, under loadLock
+    struct csc452_dir_bucket *dirtyBuckets;
+    int queued;         //on dirtyDirs, under dirLock
+    struct csc452_dir_cache *hashNext;  //next in the same bucket, under dirLock
+    struct csc452_dir_cache *dirtyNext; //next on dirtyDirs, under dirLock
+};
+
+//Buckets in the table of open files (power of two)
+#define NODE_BUCKETS 256
+
+//Every SKIP_STRIDE-th block of a chain is remembered in the skip index
+#define SKIP_STRIDE 64
+
+/**
+ * A file that some operation is using, found by its start block. The lock
+ * guards the file's chain and data, so reads of different files never wait
+ * on each other and writes to one file are serialized.
+ *
+ * The skip index is built lazily as offsets deep in the file are reached,
+ * so no seek walks more than SKIP_STRIDE FAT entries past the nearest
+ * entry. Growing a chain leaves existing entries valid; anything that cuts
+ * a chain must empty the index under skipLock.
+ */
+struct csc452_node {
+    long startBlock;
+    off_t size;                 //current size, ahead of the directory entry mid-write
+    int refs;                   //operations using the node, guarded by nodeLock
+    pthread_rwlock_t lock;
+    pthread_mutex_t skipLock;   //readers share lock, so the index has its own
+    long *skip;                 //skip[k] is the block at logical k * SKIP_STRIDE
+    long skipLen;               //entries filled in
+    long skipCap;               //entries allocated
+    long cuts;                  //times the chain was cut short, under lock
+    int unlinked;               //entry is gone; the last reference frees the chain
+    int spliced;                //read_buf gave out segments of the chain, under skipLock
+    long *held;                 //chains cut off since, freed with the last reference
+    long nHeld;                 //under lock
+    struct csc452_node *next;   //next in the same bucket
+};
+
+/**
+ * An open file, kept in fuse_file_info->fh from open until release. The
+ * path is resolved once: the node carries the start block and size, the
+ * directory and name say where the entry lives, and the cursor remembers the
+ * last block touched so sequential I/O picks up from there instead of
+ * walking the FAT from the first block.
+ */
+struct csc452_handle {
+    struct csc452_node *node;
+    long dirBlock;              //start block of the directory holding the entry
+    char name[MAX_NAME + 1];    //the entry's name in that directory
+    pthread_mutex_t cursorLock; //reads through one handle can run at once
+    long cursorIndex;           //logical block number of the cursor
+    long cursorBlock;           //physical block the cursor points at
+    long cursorCuts;            //node->cuts when the cursor was set
+    int wrote;                  //written through since the last flush
+    off_t nextOffset;           //where the next read starts if reads are sequential
+    long raWindow;              //blocks to keep read ahead, 0 for random access
+    long raEnd;                 //last logical block read-ahead was queued for
+};
+
+/**
+ * Blocks for a read-ahead thread to bring in: count blocks from
+ * logical block index, found by walking on from block at logical known.
+ * The request holds a reference to the node.
+ */
+struct csc452_readahead {
+    struct csc452_node *node;
+    long cuts;          //node->cuts that known and block are good for
+    long known;
+    long block;
+    long index;
+    long count;
+};
+
+/**
+ * A data block held in the write-back cache. Entries are linked into hash
+ * chains by block number and into one LRU list, all by index; -1 ends a
+ * list. The block's bytes live at cacheData + index * blockSize.
+ */
+struct csc452_cache_entry {
+    long block;         //-1 while the entry is unused
+    int dirty;          //differs from disk
+    int hashNext;
+    int lruPrev;        //toward the most recently used
+    int lruNext;        //toward the least recently used
+};
+
+/**
+ * A dirty cache entry and its block, sorted by block for write-back
+ */
+struct csc452_dirty {
+    long block;
+    int entry;
+};
+
+/**
+ * One transfer in a batch of disk I/O, between the buffers in iov and the
+ * bytes of the image starting at offset. res is 0 once it completed, or
+ * negative errno.
+ */
+struct csc452_io {
+    int write;
+    struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    int res;
+};
+
+/**
+ * A copy of a metadata block that differs from disk, taken by sync_run so
+ * the block can be written after its lock is let go
+ */
+struct csc452_image {
+    long target;        //where the block goes
+    long dir;           //start block of the directory it belongs to, or -1 for the FAT
+    int kind;           //how a FAT block was dirty, FAT_DIRTY_*
+};
+
+/**
+ * State that lives for the whole mount. main allocates it with the mount
+ * options filled in and FUSE hands it to each callback as private_data;
+ * helpers take it as their first argument. The disk image is opened once
+ * in csc452_init and every helper does positioned I/O on that descriptor.
+ *
+ * FUSE calls us from many threads. Locks are always taken in the order
+ * rootLock, a directory's lock, a node's lock, fatLock, cacheLock,
+ * nodeLock, raLock. dirLock is only held on its own or innermost.
+ */
+struct csc452_fs {
+    char *image;        //-o image=PATH, .disk by default, made absolute
+    int fd;             //descriptor of the image, -1 when not mounted
+    int useMmap;        //-o mmap: do all I/O through a mapping of the image
+    char *map;          //the mapping, NULL when I/O goes through fd
+    int useUring;       //-o uring: submit batches of block I/O to io_uring
+#ifdef HAVE_LIBURING
+    pthread_key_t ringKey;  //each FUSE thread's ring, made on first use
+#endif
+    int blockSize;      //from the superblock; -o blocksize=N when formatting
+    int prealloc;       //-o prealloc=N: blocks to reserve ahead when a file grows
+    double attrTimeout;     //-o attr_timeout=S: seconds the kernel keeps attributes
+    double entryTimeout;    //-o entry_timeout=S: seconds the kernel keeps names
+    off_t diskSize;     //size of the image in bytes
+    long nBlocks;       //blocks in the image
+    long rootBlock;     //block holding the root directory
+    long fatStart;      //first block of the FAT region, also the end of the data
+    long journalStart;  //first block of the journal
+    long journalBlocks; //blocks in the journal, 0 if the image has none
+
+    //The whole FAT region is loaded at mount time. Changes are made here and
+    //written back in batches on fsync and unmount. fatLock guards the FAT
+    //itself, the bitmap and the hint. Entries in a file's chain may be read
+    //without it by whoever holds that file's node lock.
+    pthread_mutex_t fatLock;
+    long fatBlocks;
+    uint32_t *fat;              //fatBlocks worth of entries
+    unsigned char *fatDirty;    //FAT blocks that differ from disk, FAT_DIRTY_*
+    uint64_t *freeMap;          //bit set for every free data block
+    long allocHint;             //entry the next free search starts at
+
+    //Directories are cached by start block the first time a path goes
+    //through them, the root at mount. rootLock is held for reading by
+    //everything that uses a cached directory, and for writing by mkdir and
+    //rmdir, which change the shape of the tree. dirLock guards the table
+    //and the list of directories with blocks to write back.
+    pthread_rwlock_t rootLock;
+    pthread_mutex_t dirLock;
+    struct csc452_dir_cache *dirTable[DIR_BUCKETS];
+    struct csc452_dir_cache *dirtyDirs;
+
+    //Chains whose entries are gone but maybe not from disk yet, under
+    //dirLock. sync_run frees them once the entries' removal is committed,
+    //so a crash can leak them but never hand them to another file.
+    long *freeLater;
+    long nFreeLater;
+    long freeLaterCap;
+
+    //File data goes through a bounded LRU cache so small writes to one
+    //block are merged in memory. Dirty blocks are written back in block
+    //order when an entry has to be reused and on flush, fsync and unmount.
+    //Clean entries are identical to disk.
+    pthread_mutex_t cacheLock;
+    int cacheBlocks;            //-o cache=N: entries in the cache
+    unsigned cacheBuckets;      //buckets in the block index (power of two)
+    int *cacheBucket;
+    struct csc452_cache_entry *cache;
+    char *cacheData;            //cacheBlocks blocks
+    struct csc452_dirty *cacheOrder;    //scratch for sorting dirty entries
+    struct iovec *cacheIov;     //scratch for write-back, one per entry
+    struct csc452_io *cacheIo;  //scratch for write-back, one per entry
+    int lruHead;
+    int lruTail;
+    int nDirty;                 //dirty entries
+
+    //Reads that look sequential queue the blocks after them for a few
+    //threads that read them into the cache before they are asked for
+    int noReadahead;            //-o noreadahead
+    pthread_mutex_t raLock;
+    pthread_cond_t raCond;
+    int raStarted;              //threads running
+    int raStop;                 //set at unmount
+    int raHead;                 //next request to take
+    int raCount;                //requests queued
+    struct csc452_readahead raQueue[RA_QUEUE];
+    pthread_t raThreads[RA_THREADS];
+
+    pthread_mutex_t nodeLock;
+    struct csc452_node *nodes[NODE_BUCKETS];
+    uint64_t *staleMap;         //bit set by start block for files whose pages the kernel must drop, under nodeLock
+
+    //sync_all is a group commit: a caller that finds one running waits for
+    //it and then either finds its changes covered or runs the next one
+    pthread_mutex_t syncLock;
+    pthread_cond_t syncCond;
+    int syncing;                //a sync_all is running
+    long syncStarted;           //sync_all runs begun
+    long syncDone;              //sync_all runs finished
+    int syncRes;                //result of the last one
+    uint64_t journalSeq;        //sequence number of the last transaction
+    int checkpointed;           //in-place writes of the last transaction may not be durable
+};
+
+static const struct csc452_fs fsDefaults = {
+        .fd = -1,
+        .attrTimeout = DEFAULT_ATTR_TIMEOUT,
+        .entryTimeout = DEFAULT_ENTRY_TIMEOUT,
+        .fatLock = PTHREAD_MUTEX_INITIALIZER,
+        .rootLock = PTHREAD_RWLOCK_INITIALIZER,
+        .dirLock = PTHREAD_MUTEX_INITIALIZER,
+        .cacheLock = PTHREAD_MUTEX_INITIALIZER,
+        .raLock = PTHREAD_MUTEX_INITIALIZER,
+        .raCond = PTHREAD_COND_INITIALIZER,
+        .nodeLock = PTHREAD_MUTEX_INITIALIZER,
+        .syncLock = PTHREAD_MUTEX_INITIALIZER,
+        .syncCond = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * Reads len bytes at offset from the disk, retrying short reads
+ * @return 0 on success, negative errno on failure
+ */
+static int disk_read(struct csc452_fs *fs, void *buf, size_t len, off_t offset)
+{
+    if (fs->map != NULL) {
+        if (offset < 0 || offset + (off_t) len > fs->diskSize) {
+            return -EIO;
+        }
+        memcpy(buf, fs->map + offset, len);
+        return 0;
+    }
+
+    char *pos = buf;
+    while (len > 0) {
+        ssize_t n = pread(fs->fd, pos, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        } else if (n == 0) {
+            return -EIO;
+        }
+        pos += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Writes len bytes at offset to the disk, retrying short writes
+ * @return 0 on success, negative errno on failure
+ */
+static int disk_write(struct csc452_fs *fs, const void *buf, size_t len, off_t offset)
+{
+    if (fs->map != NULL) {
+        if (offset < 0 || offset + (off_t) len > fs->diskSize) {
+            return -EIO;
+        }
+        memcpy(fs->map + offset, buf, len);
+        return 0;
+    }
+
+    const char *pos = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fs->fd, pos, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        pos += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Maps the whole image for -o mmap. If that fails, I/O stays on the
+ * descriptor.
+ */
+static void disk_map(struct csc452_fs *fs)
+{
+    void *map = mmap(NULL, fs->diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "csc452: cannot map %s, using pread/pwrite: %s\n", fs->image, strerror(errno));
+        return;
+    }
+    fs->map = map;
+}
+
+/**
+ * Makes everything written so far durable
+ * @return 0 on success, negative errno on failure
+ */
+static int disk_sync(struct csc452_fs *fs, int dataOnly)
+{
+    if (fs->map != NULL) {
+        return msync(fs->map, fs->diskSize, MS_SYNC) == 0 ? 0 : -errno;
+    }
+    return (dataOnly ? fdatasync(fs->fd) : fsync(fs->fd)) == 0 ? 0 : -errno;
+}
+
+/**
+ * Reads one whole block
+ */
+static int read_block(struct csc452_fs *fs, void *buf, long block)
+{
+    return disk_read(fs, buf, fs->blockSize, (off_t) block * fs->blockSize);
+}
+
+/**
+ * Writes one whole block
+ */
+static int write_block(struct csc452_fs *fs, const void *buf, long block)
+{
+    return disk_write(fs, buf, fs->blockSize, (off_t) block * fs->blockSize);
+}
+
+/**
+ * Writes an array of buffers to consecutive bytes at offset, retrying short
+ * writes. The iovecs are consumed as they are written.
+ * @return 0 on success, negative errno on failure
+ */
+static int disk_writev(struct csc452_fs *fs, struct iovec *iov, int count, off_t offset)
+{
+    if (fs->map != NULL) {
+        for (int i = 0; i < count; i++) {
+            int res = disk_write(fs, iov[i].iov_base, iov[i].iov_len, offset);
+            if (res != 0) {
+                return res;
+            }
+            offset += iov[i].iov_len;
+        }
+        return 0;
+    }
+
+    while (count > 0) {
+        ssize_t n = pwritev(fs->fd, iov, count, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        offset += n;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads consecutive bytes at offset into an array of buffers, retrying
+ * short reads. The iovecs are consumed as they are filled.
+ * @return 0 on success, negative errno on failure
+ */
+static int disk_readv(struct csc452_fs *fs, struct iovec *iov, int count, off_t offset)
+{
+    while (count > 0) {
+        if (fs->map != NULL) {
+            int res = disk_read(fs, iov->iov_base, iov->iov_len, offset);
+            if (res != 0) {
+                return res;
+            }
+            offset += iov->iov_len;
+            iov++;
+            count--;
+            continue;
+        }
+
+        ssize_t n = preadv(fs->fd, iov, count, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        } else if (n == 0) {
+            return -EIO;
+        }
+        offset += n;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Does one transfer of a batch with blocking calls, leaving its iovecs
+ * as they were
+ * @return 0 on success, negative errno on failure
+ */
+static int io_sync(struct csc452_fs *fs, struct csc452_io *io)
+{
+    struct iovec iov[64];
+    int count = io->iovcnt < 64 ? io->iovcnt : 64;
+
+    memcpy(iov, io->iov, count * sizeof(struct iovec));
+    io->res = io->write ? disk_writev(fs, iov, count, io->offset) : disk_readv(fs, iov, count, io->offset);
+    return io->res;
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * Frees a thread's ring when the thread exits
+ */
+static void ring_free(void *ring)
+{
+    io_uring_queue_exit(ring);
+    free(ring);
+}
+
+/**
+ * Gets the calling thread's ring, setting it up on first use
+ * @return the ring, or NULL if io_uring can't be used from this thread
+ */
+static struct io_uring *thread_ring(struct csc452_fs *fs)
+{
+    struct io_uring *ring = pthread_getspecific(fs->ringKey);
+    if (ring == NULL && (ring = malloc(sizeof(struct io_uring))) != NULL) {
+        if (io_uring_queue_init(URING_ENTRIES, ring, 0) != 0) {
+            free(ring);
+            return NULL;
+        }
+        pthread_setspecific(fs->ringKey, ring);
+    }
+    return ring;
+}
+
+/**
+ * Submits a batch to io_uring, URING_ENTRIES transfers at a time, and waits
+ * for all of them. Linked transfers run in order and a failure cancels the
+ * rest of the chunk's chain. Transfers that come back short are finished
+ * with blocking calls unless an earlier linked one failed.
+ * @return 0 on success, or the first negative errno
+ */
+static int ring_batch(struct csc452_fs *fs, struct io_uring *ring, struct csc452_io *io, int count, int linked)
+{
+    int res = 0;
+
+    for (int base = 0; base < count; base += URING_ENTRIES) {
+        int n = count - base < URING_ENTRIES ? count - base : URING_ENTRIES;
+        for (int i = 0; i < n; i++) {
+            struct csc452_io *x = &io[base + i];
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            if (x->write) {
+                io_uring_prep_writev(sqe, fs->fd, x->iov, x->iovcnt, x->offset);
+            } else {
+                io_uring_prep_readv(sqe, fs->fd, x->iov, x->iovcnt, x->offset);
+            }
+            io_uring_sqe_set_data(sqe, x);
+            if (linked && i + 1 < n) {
+                io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            }
+        }
+
+        int err = io_uring_submit_and_wait(ring, n);
+        if (err < 0) {
+            return err;
+        }
+        for (int i = 0; i < n; i++) {
+            struct io_uring_cqe *cqe;
+            if ((err = io_uring_wait_cqe(ring, &cqe)) != 0) {
+                return err;
+            }
+            struct csc452_io *x = io_uring_cqe_get_data(cqe);
+            size_t len = 0;
+            for (int k = 0; k < x->iovcnt; k++) {
+                len += x->iov[k].iov_len;
+            }
+            // Anything short of the whole transfer is redone below
+            x->res = cqe->res >= 0 && (size_t) cqe->res == len ? 0 : cqe->res < 0 ? cqe->res : -EAGAIN;
+            io_uring_cqe_seen(ring, cqe);
+        }
+
+        for (int i = base; i < base + n; i++) {
+            if (io[i].res != 0 && !(linked && res != 0)) {
+                io_sync(fs, &io[i]);
+            }
+            if (io[i].res != 0 && res == 0) {
+                res = io[i].res;
+            }
+        }
+        if (linked && res != 0) {
+            break;
+        }
+    }
+    return res;
+}
+#endif
+
+/**
+ * Does a batch of transfers. With -o uring they are submitted together and
+ * overlap; otherwise they run one after another. Each transfer's res says
+ * how it went. A linked batch stops at the first failure so nothing after
+ * it reaches the disk.
+ * @return 0 on success, or the first negative errno
+ */
+static int disk_batch(struct csc452_fs *fs, struct csc452_io *io, int count, int linked)
+{
+    int res = 0;
+
+#ifdef HAVE_LIBURING
+    struct io_uring *ring = fs->useUring && fs->map == NULL ? thread_ring(fs) : NULL;
+    if (ring != NULL) {
+        return ring_batch(fs, ring, io, count, linked);
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        io[i].res = -ECANCELED;
+    }
+    for (int i = 0; i < count; i++) {
+        if (io_sync(fs, &io[i]) != 0 && res == 0) {
+            res = io[i].res;
+            if (linked) {
+                break;
+            }
+        }
+    }
+    return res;
+}
+
+/**
+ * Where the bytes of a write come from: the flat buffer passed to write,
+ * or the bufvec passed to write_buf, which may be a pipe spliced from the
+ * FUSE device. Bytes are consumed in order either way.
+ */
+struct csc452_source {
+    const char *mem;
+    struct fuse_bufvec *vec;
+};
+
+/**
+ * Takes the next n bytes of a write into memory
+ * @return 0 on success, negative errno on failure
+ */
+static int source_copy(struct csc452_source *src, char *dst, size_t n)
+{
+    if (src->vec == NULL) {
+        memcpy(dst, src->mem, n);
+        src->mem += n;
+        return 0;
+    }
+#if FUSE_VERSION >= 29
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(n);
+    out.buf[0].mem = dst;
+    ssize_t res = fuse_buf_copy(&out, src->vec, 0);
+    return res < 0 ? (int) res : (size_t) res == n ? 0 : -EIO;
+#else
+    return -EIO;
+#endif
+}
+
+/**
+ * Writes the next n bytes of a write to the disk at offset. A bufvec
+ * source is handed to fuse_buf_copy, which splices when it can.
+ * @return 0 on success, negative errno on failure
+ */
+static int source_write(struct csc452_fs *fs, struct csc452_source *src, size_t n, off_t offset)
+{
+    if (src->vec == NULL) {
+        int res = disk_write(fs, src->mem, n, offset);
+        src->mem += n;
+        return res;
+    }
+    if (fs->map != NULL) {
+        if (offset < 0 || offset + (off_t) n > fs->diskSize) {
+            return -EIO;
+        }
+        return source_copy(src, fs->map + offset, n);
+    }
+#if FUSE_VERSION >= 29
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(n);
+    out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    out.buf[0].fd = fs->fd;
+    out.buf[0].pos = offset;
+    ssize_t res = fuse_buf_copy(&out, src->vec, 0);
+    return res < 0 ? (int) res : (size_t) res == n ? 0 : -EIO;
+#else
+    return -EIO;
+#endif
+}
+
+/**
+ * Gives the bytes of a cache entry
+ */
+static char *cache_data(struct csc452_fs *fs, int i)
+{
+    return fs->cacheData + (size_t) i * fs->blockSize;
+}
+
+/**
+ * Finds the cache entry holding block. The caller holds cacheLock.
+ * @return the entry, or -1 if the block isn't cached
+ */
+static int cache_find(struct csc452_fs *fs, long block)
+{
+    int i = fs->cacheBucket[block & (fs->cacheBuckets - 1)];
+    while (i != -1 && fs->cache[i].block != block) {
+        i = fs->cache[i].hashNext;
+    }
+    return i;
+}
+
+/**
+ * Moves an entry to the most recently used end of the LRU list
+ */
+static void cache_touch(struct csc452_fs *fs, int i)
+{
+    struct csc452_cache_entry *e = &fs->cache[i];
+    if (fs->lruHead == i) {
+        return;
+    }
+
+    // Unlink, then push on the head
+    fs->cache[e->lruPrev].lruNext = e->lruNext;
+    if (e->lruNext != -1) {
+        fs->cache[e->lruNext].lruPrev = e->lruPrev;
+    } else {
+        fs->lruTail = e->lruPrev;
+    }
+    e->lruPrev = -1;
+    e->lruNext = fs->lruHead;
+    fs->cache[fs->lruHead].lruPrev = i;
+    fs->lruHead = i;
+}
+
+/**
+ * Orders dirty entries by the block they hold, for qsort
+ */
+static int cache_compare(const void *a, const void *b)
+{
+    long x = ((const struct csc452_dirty *) a)->block;
+    long y = ((const struct csc452_dirty *) b)->block;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes every dirty entry back in block order, one pwritev per run of
+ * adjacent blocks, with the runs submitted as one batch. The caller holds
+ * cacheLock.
+ * @return 0 on success, or the first negative errno
+ */
+static int cache_flush(struct csc452_fs *fs)
+{
+    int n = 0;
+    int runs = 0;
+
+    if (fs->nDirty == 0) {
+        return 0;
+    }
+    for (int i = 0; i < fs->cacheBlocks; i++) {
+        if (fs->cache[i].dirty) {
+            fs->cacheOrder[n].block = fs->cache[i].block;
+            fs->cacheOrder[n++].entry = i;
+        }
+    }
+    qsort(fs->cacheOrder, n, sizeof(struct csc452_dirty), cache_compare);
+
+    for (int i = 0; i < n; ) {
+        long first = fs->cacheOrder[i].block;
+        struct csc452_io *io = &fs->cacheIo[runs++];
+        io->write = 1;
+        io->iov = &fs->cacheIov[i];
+        io->iovcnt = 0;
+        io->offset = (off_t) first * fs->blockSize;
+        while (i < n && io->iovcnt < 64 && fs->cacheOrder[i].block == first + io->iovcnt) {
+            io->iov[io->iovcnt].iov_base = cache_data(fs, fs->cacheOrder[i].entry);
+            io->iov[io->iovcnt].iov_len = fs->blockSize;
+            io->iovcnt++;
+            i++;
+        }
+    }
+
+    int res = disk_batch(fs, fs->cacheIo, runs, 0);
+
+    // Runs that failed stay dirty so a later flush can retry them
+    for (int r = 0, i = 0; r < runs; i += fs->cacheIo[r].iovcnt, r++) {
+        if (fs->cacheIo[r].res == 0) {
+            for (int k = i; k < i + fs->cacheIo[r].iovcnt; k++) {
+                fs->cache[fs->cacheOrder[k].entry].dirty = 0;
+                fs->nDirty--;
+            }
+        }
+    }
+    return res;
+}
+
+/**
+ * Empties a cache entry, dropping any changes it holds. The caller holds
+ * cacheLock.
+ */
+static void cache_forget(struct csc452_fs *fs, int i)
+{
+    struct csc452_cache_entry *e = &fs->cache[i];
+    int *link = &fs->cacheBucket[e->block & (fs->cacheBuckets - 1)];
+    while (*link != i) {
+        link = &fs->cache[*link].hashNext;
+    }
+    *link = e->hashNext;
+    if (e->dirty) {
+        e->dirty = 0;
+        fs->nDirty--;
+    }
+    e->block = -1;
+}
+
+/**
+ * Gets the cache entry for block, taking the least recently used entry if
+ * the block isn't cached. Reusing a dirty entry writes back all dirty
+ * entries first, so write-back happens in sorted batches. The caller holds
+ * cacheLock.
+ * @param load read the block's old contents into a new entry
+ * @return the entry, or negative errno
+ */
+static int cache_get(struct csc452_fs *fs, long block, int load)
+{
+    int i = cache_find(fs, block);
+    if (i != -1) {
+        cache_touch(fs, i);
+        return i;
+    }
+
+    i = fs->lruTail;
+    struct csc452_cache_entry *e = &fs->cache[i];
+    if (e->dirty) {
+        int err = cache_flush(fs);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    // Take the entry out of its hash chain before giving it the new block
+    if (e->block != -1) {
+        cache_forget(fs, i);
+    }
+    if (load) {
+        int err = read_block(fs, cache_data(fs, i), block);
+        if (err != 0) {
+            return err;
+        }
+    }
+    e->block = block;
+    e->hashNext = fs->cacheBucket[block & (fs->cacheBuckets - 1)];
+    fs->cacheBucket[block & (fs->cacheBuckets - 1)] = i;
+    cache_touch(fs, i);
+    return i;
+}
+
+/**
+ * Copies the next n bytes of a write into block at offset through the
+ * cache. The block is only read from disk when the write covers part of it.
+ * @return 0 on success, or negative errno
+ */
+static int cache_write(struct csc452_fs *fs, long block, struct csc452_source *src, size_t offset, size_t n)
+{
+    // A bufvec can fail partway through, so it is copied aside first and
+    // the entry only ever takes the whole write
+    struct csc452_source whole = {NULL, NULL};
+    char *scratch = NULL;
+    if (src->vec != NULL) {
+        if ((scratch = malloc(n)) == NULL) {
+            return -ENOMEM;
+        }
+        int err = source_copy(src, scratch, n);
+        if (err != 0) {
+            free(scratch);
+            return err;
+        }
+        whole.mem = scratch;
+        src = &whole;
+    }
+
+    pthread_mutex_lock(&fs->cacheLock);
+    int i = cache_get(fs, block, n < (size_t) fs->blockSize);
+    if (i >= 0) {
+        source_copy(src, cache_data(fs, i) + offset, n);
+        if (!fs->cache[i].dirty) {
+            fs->cache[i].dirty = 1;
+            fs->nDirty++;
+        }
+    }
+    pthread_mutex_unlock(&fs->cacheLock);
+    free(scratch);
+    return i < 0 ? i : 0;
+}
+
+/**
+ * Drops count blocks starting at first from the cache before they are
+ * overwritten on disk, so no older copy is written back over them
+ */
+static void cache_drop(struct csc452_fs *fs, long first, long count)
+{
+    pthread_mutex_lock(&fs->cacheLock);
+    if (count > fs->cacheBlocks) {
+        // Fewer entries than blocks to look up
+        for (int i = 0; i < fs->cacheBlocks; i++) {
+            if (fs->cache[i].block >= first && fs->cache[i].block < first + count) {
+                cache_forget(fs, i);
+            }
+        }
+    } else {
+        for (long b = first; b < first + count; b++) {
+            int i = cache_find(fs, b);
+            if (i != -1) {
+                cache_forget(fs, i);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->cacheLock);
+}
+
+/**
+ * Reads len bytes that start skip bytes into block first and continue
+ * through the blocks right after it on disk. Blocks in the cache are copied
+ * from there and the others are read with one pread per gap, submitted
+ * together. The caller holds the file's node lock, so none of the uncached
+ * blocks can pick up new data before they are read.
+ * @return 0 on success, or negative errno
+ */
+static int cache_read(struct csc452_fs *fs, char *buf, long first, size_t skip, size_t len)
+{
+    while (len > 0) {
+        // Take up to 64 blocks at a time so one word can say which were cached
+        long nb = (skip + len + fs->blockSize - 1) / fs->blockSize;
+        if (nb > 64) {
+            nb = 64;
+        }
+        size_t chunk = (size_t) nb * fs->blockSize - skip;
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        uint64_t cached = 0;
+        pthread_mutex_lock(&fs->cacheLock);
+        for (long b = 0; b < nb; b++) {
+            int i = cache_find(fs, first + b);
+            if (i != -1) {
+                size_t from = b == 0 ? 0 : b * fs->blockSize - skip;
+                size_t to = (b + 1) * fs->blockSize - skip;
+                memcpy(buf + from, cache_data(fs, i) + (b == 0 ? skip : 0),
+                       (to < chunk ? to : chunk) - from);
+                cached |= (uint64_t) 1 << b;
+            }
+        }
+        pthread_mutex_unlock(&fs->cacheLock);
+
+        // Read the gaps between cached blocks as one batch
+        struct csc452_io io[32];
+        struct iovec iov[32];
+        int gaps = 0;
+        for (long b = 0; b < nb; ) {
+            if (cached >> b & 1) {
+                b++;
+                continue;
+            }
+            long end = b;
+            while (end < nb && !(cached >> end & 1)) {
+                end++;
+            }
+            size_t from = b == 0 ? 0 : b * fs->blockSize - skip;
+            size_t to = end * fs->blockSize - skip;
+            if (to > chunk) {
+                to = chunk;
+            }
+            iov[gaps].iov_base = buf + from;
+            iov[gaps].iov_len = to - from;
+            io[gaps].write = 0;
+            io[gaps].iov = &iov[gaps];
+            io[gaps].iovcnt = 1;
+            io[gaps].offset = (off_t) first * fs->blockSize + skip + from;
+            gaps++;
+            b = end;
+        }
+        int err = disk_batch(fs, io, gaps, 0);
+        if (err != 0) {
+            return err;
+        }
+
+        buf += chunk;
+        len -= chunk;
+        first += nb;
+        skip = 0;
+    }
+    return 0;
+}
+
+/**
+ * Smallest power of two that is at least n
+ */
+static unsigned pow2_at_least(unsigned n)
+{
+    unsigned p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/**
+ * Sets up an empty cache of cacheBlocks entries
+ * @return 0 on success, -ENOMEM
+ */
+static int cache_init(struct csc452_fs *fs)
+{
+    if (fs->cacheBlocks <= 0) {
+        fs->cacheBlocks = DEFAULT_CACHE_BYTES / fs->blockSize;
+    }
+    if (fs->cacheBlocks < MIN_CACHE_BLOCKS) {
+        fs->cacheBlocks = MIN_CACHE_BLOCKS;
+    }
+    fs->cacheBuckets = pow2_at_least(fs->cacheBlocks);
+    fs->cacheBucket = malloc(fs->cacheBuckets * sizeof(int));
+    fs->cache = malloc(fs->cacheBlocks * sizeof(struct csc452_cache_entry));
+    fs->cacheData = malloc((size_t) fs->cacheBlocks * fs->blockSize);
+    fs->cacheOrder = malloc(fs->cacheBlocks * sizeof(struct csc452_dirty));
+    fs->cacheIov = malloc(fs->cacheBlocks * sizeof(struct iovec));
+    fs->cacheIo = malloc(fs->cacheBlocks * sizeof(struct csc452_io));
+    if (fs->cacheBucket == NULL || fs->cache == NULL || fs->cacheData == NULL || fs->cacheOrder == NULL ||
+        fs->cacheIov == NULL || fs->cacheIo == NULL) {
+        return -ENOMEM;
+    }
+
+    for (unsigned b = 0; b < fs->cacheBuckets; b++) {
+        fs->cacheBucket[b] = -1;
+    }
+    for (int i = 0; i < fs->cacheBlocks; i++) {
+        fs->cache[i].block = -1;
+        fs->cache[i].dirty = 0;
+        fs->cache[i].hashNext = -1;
+        fs->cache[i].lruPrev = i - 1;
+        fs->cache[i].lruNext = i + 1 < fs->cacheBlocks ? i + 1 : -1;
+    }
+    fs->lruHead = 0;
+    fs->lruTail = fs->cacheBlocks - 1;
+    fs->nDirty = 0;
+    return 0;
+}
+
+/**
+ * Gets the FAT entry of a block
+ */
+uint32_t get_fat_val(struct csc452_fs *fs, long block)
+{
+    if (block < 0 || block >= fs->nBlocks) {
+        return FAT_FREE;
+    }
+    return fs->fat[block];
+}
+
+/**
+ * Follows a chain one block
+ * @return the block after block, or -1 at the end of the chain
+ */
+static long next_block(struct csc452_fs *fs, long block)
+{
+    uint32_t next = get_fat_val(fs, block);
+    if (next == FAT_FREE || next >= (uint32_t) fs->nBlocks) {
+        return -1;
+    }
+    return next;
+}
+
+/**
+ * Slots in a cached directory's table
+ */
+static unsigned dir_slots(struct csc452_dir_cache *dir)
+{
+    return 1u << dir->head->depth;
+}
+
+/**
+ * Gets entry i of a bucket
+ */
+static struct csc452_file_directory *bucket_entry(struct csc452_dir_bucket *bucket, int i)
+{
+    return &bucket->data->files[i];
+}
+
+/**
+ * Gets the name of entry i of a bucket, which is not nul terminated
+ */
+static const char *bucket_name(struct csc452_dir_bucket *bucket, int i)
+{
+    return (const char *) bucket->data + bucket->data->files[i].nameOffset;
+}
+
+/**
+ * Frees a bucket's memory
+ */
+static void bucket_free(struct csc452_dir_bucket *bucket)
+{
+    if (bucket != NULL) {
+        free(bucket->data);
+        free(bucket);
+    }
+}
+
+/**
+ * Makes an empty bucket for block
+ * @return the bucket, or NULL if out of memory
+ */
+static struct csc452_dir_bucket *bucket_new(struct csc452_fs *fs, long block)
+{
+    struct csc452_dir_bucket *bucket = calloc(1, sizeof(struct csc452_dir_bucket));
+    if (bucket != NULL) {
+        bucket->block = block;
+        bucket->data = calloc(1, fs->blockSize);
+    }
+    if (bucket != NULL && bucket->data == NULL) {
+        bucket_free(bucket);
+        bucket = NULL;
+    }
+    return bucket;
+}
+
+/**
+ * Does a bucket just read in hold together: do its entries and names fit,
+ * and is every name inside the names at the end of the block?
+ */
+static int bucket_valid(struct csc452_fs *fs, const csc452_directory_entry *data)
+{
+    size_t space = CSC452_BUCKET_SPACE(fs->blockSize);
+    if (data->nFiles < 0 || data->nameBytes > space ||
+        (size_t) data->nFiles * sizeof(struct csc452_file_directory) > space - data->nameBytes) {
+        return 0;
+    }
+    for (int i = 0; i < data->nFiles; i++) {
+        const struct csc452_file_directory *f = &data->files[i];
+        if (f->nameLen == 0 || f->nameOffset < fs->blockSize - data->nameBytes ||
+            f->nameOffset + f->nameLen > fs->blockSize) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Puts the directory on dirtyDirs for the next sync_all
+ */
+static void dir_queue(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    pthread_mutex_lock(&fs->dirLock);
+    if (!dir->queued) {
+        dir->queued = 1;
+        dir->dirtyNext = fs->dirtyDirs;
+        fs->dirtyDirs = dir;
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+}
+
+/**
+ * Marks a cached directory's first block for the next sync_all. These and
+ * the other dirty markers are called with the directory's lock held for
+ * writing.
+ */
+static void head_dirty(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    dir->headDirty = 1;
+    dir_queue(fs, dir);
+}
+
+/**
+ * Marks the block holding table slot s for the next sync_all
+ */
+static void table_dirty(struct csc452_fs *fs, struct csc452_dir_cache *dir, unsigned s)
+{
+    if (dir->head->nTableBlocks == 0) {
+        dir->headDirty = 1;
+    } else {
+        dir->tableDirty[s / CSC452_DIR_SLOTS_PER_BLOCK(fs->blockSize)] = 1;
+    }
+    dir_queue(fs, dir);
+}
+
+/**
+ * Marks a bucket for the next sync_all
+ */
+static void bucket_dirty(struct csc452_fs *fs, struct csc452_dir_cache *dir, struct csc452_dir_bucket *bucket)
+{
+    if (!bucket->dirty) {
+        bucket->dirty = 1;
+        bucket->dirtyNext = dir->dirtyBuckets;
+        dir->dirtyBuckets = bucket;
+    }
+    dir_queue(fs, dir);
+}
+
+/**
+ * Reads in the table block holding slot s, if the table has blocks of its
+ * own and that one hasn't been read yet. The caller holds loadLock, or the
+ * directory's lock for writing.
+ * @return 0 on success, or negative errno
+ */
+static int table_load(struct csc452_fs *fs, struct csc452_dir_cache *dir, unsigned s)
+{
+    long k = s / CSC452_DIR_SLOTS_PER_BLOCK(fs->blockSize);
+    if (dir->head->nTableBlocks == 0 || dir->tableLoaded[k]) {
+        return 0;
+    }
+    long block = dir->head->table[k];
+    if (block <= fs->rootBlock || block >= fs->fatStart) {
+        return -EIO;
+    }
+    int res = read_block(fs, dir->tableData + (size_t) k * fs->blockSize, block);
+    dir->tableLoaded[k] = res == 0;
+    return res;
+}
+
+/**
+ * Gets the bucket table slot s points at, reading it in if no lookup has
+ * yet. Readers holding the directory's lock for reading may race to read
+ * the same bucket, so they do it under loadLock and publish it to every
+ * slot that shares it at once, whether or not those slots' table blocks
+ * have been read.
+ * @param bucket set to the bucket, or NULL if the directory has none yet
+ * @return 0 on success, or negative errno
+ */
+static int dir_bucket(struct csc452_fs *fs, struct csc452_dir_cache *dir, unsigned s,
+                      struct csc452_dir_bucket **bucket)
+{
+    *bucket = __atomic_load_n(&dir->slots[s], __ATOMIC_ACQUIRE);
+    if (*bucket != NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&dir->loadLock);
+    struct csc452_dir_bucket *b = __atomic_load_n(&dir->slots[s], __ATOMIC_RELAXED);
+    int res = b == NULL ? table_load(fs, dir, s) : 0;
+    long block = res == 0 && b == NULL ? dir->table[s] : 0;
+    if (block != 0) {
+        if (block <= fs->rootBlock || block >= fs->fatStart) {
+            res = -EIO;
+        } else if ((b = bucket_new(fs, block)) == NULL) {
+            res = -ENOMEM;
+        } else {
+            res = read_block(fs, b->data, block);
+        }
+
+        // A bucket has every slot that agrees with s in its low depth bits
+        uint32_t depth = res == 0 ? b->data->depth : 0;
+        unsigned first = s & ((1u << (depth & 31)) - 1);
+        unsigned perBlock = CSC452_DIR_SLOTS_PER_BLOCK(fs->blockSize);
+        if (res == 0 && (depth > dir->head->depth || !bucket_valid(fs, b->data))) {
+            res = -EIO;
+        }
+        for (unsigned t = first; res == 0 && t < dir_slots(dir); t += 1u << depth) {
+            if ((dir->head->nTableBlocks == 0 || dir->tableLoaded[t / perBlock]) && dir->table[t] != block) {
+                res = -EIO;
+            }
+        }
+        if (res == 0) {
+            b->next = dir->buckets;
+            dir->buckets = b;
+            for (unsigned t = first; t < dir_slots(dir); t += 1u << depth) {
+                __atomic_store_n(&dir->slots[t], b, __ATOMIC_RELEASE);
+            }
+        } else {
+            bucket_free(b);
+            b = NULL;
+        }
+    }
+    pthread_mutex_unlock(&dir->loadLock);
+    *bucket = b;
+    return res;
+}
+
+/**
+ * Reads a directory's first block into its cache slot and makes room for
+ * its table. The caller holds the slot's lock for writing.
+ * @return 0 on success, or negative errno
+ */
+static int load_directory(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    uint32_t bs = fs->blockSize;
+    if (dir->head == NULL && (dir->head = malloc(bs)) == NULL) {
+        return -ENOMEM;
+    }
+    int res = read_block(fs, dir->head, dir->startBlock);
+    if (res != 0) {
+        return res;
+    }
+
+    struct csc452_dir_header *head = dir->head;
+    unsigned slots = 1u << (head->depth & 31);
+    long nTable = slots > CSC452_DIR_INLINE_SLOTS(bs) ? slots / CSC452_DIR_SLOTS_PER_BLOCK(bs) : 0;
+    if (head->depth > dir_max_depth(bs) || head->nTableBlocks != nTable) {
+        return -EIO;
+    }
+    free(dir->slots);
+    dir->slots = calloc(slots, sizeof(struct csc452_dir_bucket *));
+    free(dir->tableData);
+    dir->tableData = malloc((size_t) (nTable + 1) * bs);
+    free(dir->tableLoaded);
+    dir->tableLoaded = calloc(nTable + 1, 1);
+    free(dir->tableDirty);
+    dir->tableDirty = calloc(nTable + 1, 1);
+    if (dir->slots == NULL || dir->tableData == NULL || dir->tableLoaded == NULL || dir->tableDirty == NULL) {
+        return -ENOMEM;
+    }
+    dir->table = nTable > 0 ? (uint32_t *) dir->tableData : head->table;
+    dir->loaded = 1;
+    return 0;
+}
+
+/**
+ * Sets up the cache slot of a directory that mkdir just made: one block of
+ * zeros, written with the next sync_all
+ * @return 0 on success, or -ENOMEM
+ */
+static int dir_make_empty(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    dir->head = calloc(1, fs->blockSize);
+    dir->slots = calloc(1, sizeof(struct csc452_dir_bucket *));
+    dir->tableLoaded = calloc(1, 1);
+    dir->tableDirty = calloc(1, 1);
+    if (dir->head == NULL || dir->slots == NULL || dir->tableLoaded == NULL || dir->tableDirty == NULL) {
+        return -ENOMEM;
+    }
+    dir->table = dir->head->table;
+    dir->loaded = 1;
+    head_dirty(fs, dir);
+    return 0;
+}
+
+/**
+ * Gets the cache slot of the directory starting at startBlock, making an
+ * empty one if it isn't cached and create is set. The caller holds
+ * rootLock.
+ * @return the slot, or NULL if there is none or out of memory
+ */
+static struct csc452_dir_cache *dir_get(struct csc452_fs *fs, long startBlock, int create)
+{
+    struct csc452_dir_cache **head = &fs->dirTable[startBlock & (DIR_BUCKETS - 1)];
+    struct csc452_dir_cache *dir;
+
+    pthread_mutex_lock(&fs->dirLock);
+    for (dir = *head; dir != NULL && dir->startBlock != startBlock; dir = dir->hashNext) {
+    }
+    if (dir == NULL && create && (dir = calloc(1, sizeof(struct csc452_dir_cache))) != NULL) {
+        pthread_rwlock_init(&dir->lock, NULL);
+        pthread_mutex_init(&dir->loadLock, NULL);
+        dir->startBlock = startBlock;
+        dir->hashNext = *head;
+        *head = dir;
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    return dir;
+}
+
+/**
+ * Takes a directory out of the cache and frees it. The caller holds
+ * rootLock for writing, so no one else can be using it.
+ */
+static void dir_forget(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    pthread_mutex_lock(&fs->dirLock);
+    struct csc452_dir_cache **link = &fs->dirTable[dir->startBlock & (DIR_BUCKETS - 1)];
+    while (*link != dir) {
+        link = &(*link)->hashNext;
+    }
+    *link = dir->hashNext;
+    if (dir->queued) {
+        for (link = &fs->dirtyDirs; *link != dir; link = &(*link)->dirtyNext) {
+        }
+        *link = dir->dirtyNext;
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+
+    while (dir->buckets != NULL) {
+        struct csc452_dir_bucket *bucket = dir->buckets;
+        dir->buckets = bucket->next;
+        bucket_free(bucket);
+    }
+    pthread_rwlock_destroy(&dir->lock);
+    pthread_mutex_destroy(&dir->loadLock);
+    free(dir->head);
+    free(dir->tableData);
+    free(dir->tableLoaded);
+    free(dir->tableDirty);
+    free(dir->slots);
+    free(dir);
+}
+
+/**
+ * takes in a directory's start block and returns it cached and locked for
+ * reading or writing, reading in its first block and table on first use.
+ * The caller holds rootLock and releases the directory with
+ * unlock_directory.
+ * @param write nonzero to lock for writing
+ * @return the cached directory, or NULL if it can't be read
+ */
+static struct csc452_dir_cache *lock_directory(struct csc452_fs *fs, long startBlock, int write)
+{
+    struct csc452_dir_cache *dir = dir_get(fs, startBlock, 1);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    // Once loaded a slot stays loaded, so a reader only locks it
+    // exclusively the first time through
+    if (!write) {
+        pthread_rwlock_rdlock(&dir->lock);
+        if (dir->loaded) {
+            return dir;
+        }
+        pthread_rwlock_unlock(&dir->lock);
+    }
+    pthread_rwlock_wrlock(&dir->lock);
+    if (!dir->loaded && load_directory(fs, dir) != 0) {
+        pthread_rwlock_unlock(&dir->lock);
+        return NULL;
+    }
+    if (!write) {
+        pthread_rwlock_unlock(&dir->lock);
+        pthread_rwlock_rdlock(&dir->lock);
+    }
+    return dir;
+}
+
+static void unlock_directory(struct csc452_dir_cache *dir)
+{
+    pthread_rwlock_unlock(&dir->lock);
+}
+
+/**
+ * Finds a file's entry in a cached directory: one slot of the table and a
+ * scan of one bucket, compared by hash first
+ * @param bucket set to the bucket the entry is in, or would go in
+ * @return the entry's number in the bucket, -ENOENT if there is no such
+ * file, or negative errno if the bucket can't be read
+ */
+static int find_file(struct csc452_fs *fs, struct csc452_dir_cache *dir, const char *name, size_t len,
+                     struct csc452_dir_bucket **bucket)
+{
+    uint32_t hash = name_hash(name, len);
+    int res = dir_bucket(fs, dir, hash & (dir_slots(dir) - 1), bucket);
+    if (res != 0) {
+        return res;
+    }
+    for (int i = 0; *bucket != NULL && i < (*bucket)->data->nFiles; i++) {
+        struct csc452_file_directory *f = bucket_entry(*bucket, i);
+        if (f->hash == hash && f->nameLen == len && memcmp(bucket_name(*bucket, i), name, len) == 0) {
+            return i;
+        }
+    }
+    return -ENOENT;
+}
+
+/**
+ * Checks that one path component of len bytes can be a name
+ * @return 0 if so, -ENOENT for an empty one or -ENAMETOOLONG
+ */
+static int check_name(size_t len)
+{
+    if (len == 0) {
+        return -ENOENT;
+    } else if (len > MAX_NAME) {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+/**
+ * Walks a path through the cached directories down to the directory that
+ * holds its last component. Each step is one lookup in a directory's hash
+ * index, so the cost grows with the depth of the path and not the size of
+ * the directories on it. The caller holds rootLock.
+ * @param last set to the last component, empty for "/"
+ * @return the start block of that directory, or negative errno
+ */
+static long walk_path(struct csc452_fs *fs, const char *path, const char **last)
+{
+    long dirBlock = fs->rootBlock;
+    const char *name = path + 1;
+    const char *slash;
+
+    while ((slash = strchr(name, '/')) != NULL) {
+        int res = check_name(slash - name);
+        if (res != 0) {
+            return res;
+        }
+        struct csc452_dir_cache *dir = lock_directory(fs, dirBlock, 0);
+        if (dir == NULL) {
+            return -EIO;
+        }
+        struct csc452_dir_bucket *bucket;
+        int i = find_file(fs, dir, name, slash - name, &bucket);
+        if (i < 0) {
+            res = i;
+        } else if (bucket_entry(bucket, i)->type != CSC452_TYPE_DIR) {
+            res = -ENOTDIR;
+        } else {
+            dirBlock = bucket_entry(bucket, i)->nStartBlock;
+        }
+        unlock_directory(dir);
+        if (res != 0) {
+            return res;
+        }
+        name = slash + 1;
+    }
+    *last = name;
+    return dirBlock;
+}
+
+/**
+ * Finds the entry a path names. The root has no entry of its own, so it
+ * gets a made-up one. The caller holds rootLock.
+ * @return 0 on success, or negative errno
+ */
+static int lookup_path(struct csc452_fs *fs, const char *path, struct csc452_file_directory *entry)
+{
+    const char *last;
+
+    long dirBlock = walk_path(fs, path, &last);
+    if (dirBlock < 0) {
+        return dirBlock;
+    }
+    if (*last == '\0') {
+        memset(entry, 0, sizeof(*entry));
+        entry->nStartBlock = fs->rootBlock;
+        entry->type = CSC452_TYPE_DIR;
+        return 0;
+    }
+    int res = check_name(strlen(last));
+    if (res != 0) {
+        return res;
+    }
+
+    struct csc452_dir_cache *dir = lock_directory(fs, dirBlock, 0);
+    if (dir == NULL) {
+        return -EIO;
+    }
+    struct csc452_dir_bucket *bucket;
+    int i = find_file(fs, dir, last, strlen(last), &bucket);
+    if (i < 0) {
+        res = i;
+    } else {
+        *entry = *bucket_entry(bucket, i);
+    }
+    unlock_directory(dir);
+    return res;
+}
+
+/**
+ * Marks a data block as free or used in the free-block bitmap
+ */
+static void fat_mark(struct csc452_fs *fs, long entry, int isFree)
+{
+    if (entry <= fs->rootBlock || entry >= fs->fatStart) {
+        return;
+    }
+    if (isFree) {
+        fs->freeMap[entry / 64] |= (uint64_t) 1 << (entry % 64);
+    } else {
+        fs->freeMap[entry / 64] &= ~((uint64_t) 1 << (entry % 64));
+    }
+}
+
+/**
+ * takes in a value and block number. It sets that block's FAT entry to value
+ */
+void set_fat_block(struct csc452_fs *fs, long block, uint32_t val)
+{
+    if (block < 0 || block >= fs->nBlocks) {
+        return;
+    }
+    fs->fat[block] = val;
+    if (!fs->fatDirty[block / FAT_ENTRIES_PER_BLOCK]) {
+        fs->fatDirty[block / FAT_ENTRIES_PER_BLOCK] = FAT_DIRTY;
+    }
+    fat_mark(fs, block, val == FAT_FREE);
+}
+
+/**
+ * Ends a file's chain at block. The FAT block goes out with the
+ * directories, after the entry's smaller size. The caller holds fatLock.
+ * @return the first block cut off, or FAT_EOC if the chain ended there
+ */
+static uint32_t cut_chain(struct csc452_fs *fs, long block)
+{
+    uint32_t next = fs->fat[block];
+    set_fat_block(fs, block, FAT_EOC);
+    fs->fatDirty[block / FAT_ENTRIES_PER_BLOCK] = FAT_DIRTY_CUT;
+    return next;
+}
+
+/**
+ * Queues a chain for the next sync_run to free
+ */
+static void free_later(struct csc452_fs *fs, long block)
+{
+    pthread_mutex_lock(&fs->dirLock);
+    if (fs->nFreeLater == fs->freeLaterCap) {
+        long cap = fs->freeLaterCap ? 2 * fs->freeLaterCap : 16;
+        long *chains = realloc(fs->freeLater, cap * sizeof(long));
+        if (chains != NULL) {
+            fs->freeLater = chains;
+            fs->freeLaterCap = cap;
+        }
+    }
+    // Out of memory the chain leaks, which fsck gives back
+    if (fs->nFreeLater < fs->freeLaterCap) {
+        fs->freeLater[fs->nFreeLater++] = block;
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+}
+
+/**
+ * Gives the chain from block on back to the allocator once the entry that
+ * held it is gone from disk, which is after the next sync_all commits.
+ * Cached copies are dropped now, a run of adjacent blocks at a time, so
+ * none of them is written back over the blocks' next owner. The caller
+ * has already taken the chain out of its entry, and holds the file's node
+ * lock for writing or no one can reach the chain any more.
+ */
+static void free_chain(struct csc452_fs *fs, long block)
+{
+    long head = block;
+    long first = -1;
+    long count = 0;
+
+    pthread_mutex_lock(&fs->fatLock);
+    // Stopping at free entries also stops a damaged chain that loops
+    for (long n = 0; block > fs->rootBlock && block < fs->fatStart && n < fs->nBlocks &&
+                     fs->fat[block] != FAT_FREE && fs->fat[block] != FAT_RESERVED; n++) {
+        uint32_t next = fs->fat[block];
+        if (first != -1 && block != first + count) {
+            cache_drop(fs, first, count);
+            first = -1;
+        }
+        if (first == -1) {
+            first = block;
+            count = 0;
+        }
+        count++;
+        block = next == FAT_EOC ? -1 : (long) next;
+    }
+    if (first != -1) {
+        cache_drop(fs, first, count);
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+
+    // Queued after the entry's removal marked its directory dirty, so the
+    // sync_run that picks the chain up also commits the removal
+    free_later(fs, head);
+}
+
+/**
+ * Frees chains that free_chain queued, now that nothing on disk points at
+ * them. The FAT goes out with the next sync_all.
+ */
+static void release_chains(struct csc452_fs *fs, long *chains, long count)
+{
+    pthread_mutex_lock(&fs->fatLock);
+    for (long i = 0; i < count; i++) {
+        long block = chains[i];
+        while (block > fs->rootBlock && block < fs->fatStart &&
+               fs->fat[block] != FAT_FREE && fs->fat[block] != FAT_RESERVED) {
+            uint32_t next = fs->fat[block];
+            set_fat_block(fs, block, FAT_FREE);
+            block = next == FAT_EOC ? -1 : (long) next;
+        }
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+}
+
+/**
+ * Gets the open-file state for the file starting at startBlock, creating it
+ * with the given size if no one has the file open. Takes a reference that
+ * is dropped with node_put.
+ */
+static struct csc452_node *node_get(struct csc452_fs *fs, long startBlock, off_t size)
+{
+    unsigned bucket = startBlock & (NODE_BUCKETS - 1);
+    struct csc452_node *node;
+
+    pthread_mutex_lock(&fs->nodeLock);
+    for (node = fs->nodes[bucket]; node != NULL; node = node->next) {
+        if (node->startBlock == startBlock) {
+            break;
+        }
+    }
+    if (node == NULL && (node = calloc(1, sizeof(struct csc452_node))) != NULL) {
+        node->startBlock = startBlock;
+        node->size = size;
+        pthread_rwlock_init(&node->lock, NULL);
+        pthread_mutex_init(&node->skipLock, NULL);
+        node->next = fs->nodes[bucket];
+        fs->nodes[bucket] = node;
+    }
+    if (node != NULL) {
+        node->refs++;
+    }
+    pthread_mutex_unlock(&fs->nodeLock);
+    return node;
+}
+
+/**
+ * Takes another reference to a node someone already holds
+ */
+static void node_hold(struct csc452_fs *fs, struct csc452_node *node)
+{
+    pthread_mutex_lock(&fs->nodeLock);
+    node->refs++;
+    pthread_mutex_unlock(&fs->nodeLock);
+}
+
+/**
+ * Drops a reference from node_get, freeing the node with the last one
+ */
+static void node_put(struct csc452_fs *fs, struct csc452_node *node)
+{
+    long orphan = -1;
+    long *held = NULL;
+    long nHeld = 0;
+
+    pthread_mutex_lock(&fs->nodeLock);
+    if (--node->refs == 0) {
+        struct csc452_node **link = &fs->nodes[node->startBlock & (NODE_BUCKETS - 1)];
+        while (*link != node) {
+            link = &(*link)->next;
+        }
+        *link = node->next;
+        if (node->unlinked) {
+            orphan = node->startBlock;
+        }
+        held = node->held;
+        nHeld = node->nHeld;
+        pthread_rwlock_destroy(&node->lock);
+        pthread_mutex_destroy(&node->skipLock);
+        free(node->skip);
+        free(node);
+    }
+    pthread_mutex_unlock(&fs->nodeLock);
+
+    // A file unlinked while open keeps its blocks until now, and so do
+    // chains truncate cut off while read_buf segments could name them
+    if (orphan != -1) {
+        free_chain(fs, orphan);
+    }
+    for (long i = 0; i < nHeld; i++) {
+        free_chain(fs, held[i]);
+    }
+    free(held);
+}
+
+/**
+ * The size of a file someone has open, which is ahead of its directory
+ * entry while a write is between growing the file and updating the entry
+ * @return the size, or -1 if no one has the file open
+ */
+static off_t node_size(struct csc452_fs *fs, long startBlock)
+{
+    struct csc452_node *node;
+
+    pthread_mutex_lock(&fs->nodeLock);
+    for (node = fs->nodes[startBlock & (NODE_BUCKETS - 1)]; node != NULL; node = node->next) {
+        if (node->startBlock == startBlock) {
+            node->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->nodeLock);
+    if (node == NULL) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&node->lock);
+    off_t size = node->size;
+    pthread_rwlock_unlock(&node->lock);
+    node_put(fs, node);
+    return size;
+}
+
+/**
+ * Marks a file whose data may not be what the kernel has cached for it,
+ * after a write or truncate that failed partway. Its next open drops the
+ * kernel's pages.
+ */
+static void node_stale(struct csc452_fs *fs, long startBlock)
+{
+    pthread_mutex_lock(&fs->nodeLock);
+    fs->staleMap[startBlock / 64] |= 1ULL << (startBlock % 64);
+    pthread_mutex_unlock(&fs->nodeLock);
+}
+
+/**
+ * Whether the kernel may keep the pages it cached for a file from an
+ * earlier open. Every change that succeeds goes through the kernel, which
+ * updates its pages as it goes, so only a file marked by node_stale has
+ * to be read again; opening it clears the mark.
+ */
+static int node_keep_cache(struct csc452_fs *fs, long startBlock)
+{
+    uint64_t bit = 1ULL << (startBlock % 64);
+
+    pthread_mutex_lock(&fs->nodeLock);
+    int keep = (fs->staleMap[startBlock / 64] & bit) == 0;
+    fs->staleMap[startBlock / 64] &= ~bit;
+    pthread_mutex_unlock(&fs->nodeLock);
+    return keep;
+}
+
+/**
+ * Looks a file up by path and makes a handle for it, holding a reference
+ * to the file's open-file state. The cursor starts at the first block.
+ * @return 0 on success, or negative errno
+ */
+static int path_handle(struct csc452_fs *fs, const char *path, struct csc452_handle **handle)
+{
+    struct csc452_handle *h = calloc(1, sizeof(struct csc452_handle));
+    const char *last;
+    int res;
+
+    if (h == NULL) {
+        return -ENOMEM;
+    }
+    pthread_rwlock_rdlock(&fs->rootLock);
+    long dirBlock = walk_path(fs, path, &last);
+    struct csc452_dir_cache *dir = NULL;
+    if (dirBlock < 0) {
+        res = dirBlock;
+    } else if (*last == '\0') {
+        res = -EISDIR;
+    } else if ((res = check_name(strlen(last))) == 0 && (dir = lock_directory(fs, dirBlock, 0)) == NULL) {
+        res = -EIO;
+    }
+    if (dir != NULL) {
+        struct csc452_dir_bucket *bucket;
+        strcpy(h->name, last);
+        int i = find_file(fs, dir, h->name, strlen(h->name), &bucket);
+        struct csc452_file_directory *f = i >= 0 ? bucket_entry(bucket, i) : NULL;
+        if (f == NULL) {
+            res = i;
+        } else if (f->type == CSC452_TYPE_DIR) {
+            res = -EISDIR;
+        } else {
+            h->node = node_get(fs, f->nStartBlock, f->fsize);
+            h->dirBlock = dirBlock;
+            res = h->node != NULL ? 0 : -ENOMEM;
+        }
+        unlock_directory(dir);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+
+    if (res != 0) {
+        free(h);
+        return res;
+    }
+    pthread_mutex_init(&h->cursorLock, NULL);
+    h->cursorIndex = 0;
+    h->cursorBlock = h->node->startBlock;
+    h->cursorCuts = -1;
+    *handle = h;
+    return 0;
+}
+
+/**
+ * Drops a handle from open_handle along with its node reference
+ */
+static void close_handle(struct csc452_fs *fs, struct csc452_handle *handle)
+{
+    node_put(fs, handle->node);
+    pthread_mutex_destroy(&handle->cursorLock);
+    free(handle);
+}
+
+
+/**
+ * Update a file size in its directory entry to the node's current size.
+ * The entry is looked up again by the name it was opened under; if that
+ * name has gone or now names another file, there is nothing to update.
+ * Only the cached block changes; sync_all writes it back.
+ * @return 0 on success, or negative errno if the entry's bucket can't be read
+ */
+int update_file_size(struct csc452_fs *fs, struct csc452_handle *handle)
+{
+    struct csc452_node *node = handle->node;
+    int res = 0;
+
+    pthread_rwlock_rdlock(&fs->rootLock);
+    // A directory that still holds the file is still cached. One that isn't
+    // may have been removed, and its block may hold anything by now.
+    struct csc452_dir_cache *dir = dir_get(fs, handle->dirBlock, 0);
+    if (dir != NULL) {
+        pthread_rwlock_wrlock(&dir->lock);
+        struct csc452_dir_bucket *bucket;
+        int i = dir->loaded ? find_file(fs, dir, handle->name, strlen(handle->name), &bucket) : -ENOENT;
+        struct csc452_file_directory *f = i >= 0 ? bucket_entry(bucket, i) : NULL;
+        if (f != NULL && f->nStartBlock == node->startBlock) {
+            // Another writer may have brought it up to date already
+            pthread_rwlock_rdlock(&node->lock);
+            if (f->fsize != (uint64_t) node->size) {
+                f->fsize = node->size;
+                bucket_dirty(fs, dir, bucket);
+            }
+            pthread_rwlock_unlock(&node->lock);
+        } else if (i != -ENOENT && i < 0) {
+            res = i;
+        }
+        unlock_directory(dir);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+    return res;
+}
+
+/**
+ * Gets the handle that open left in fi, or resolves path for this call
+ * only. A handle made here is also returned in own for the caller to close.
+ * @return 0 on success, -ENOENT or -ENOMEM
+ */
+static int get_handle(struct csc452_fs *fs, const char *path, struct fuse_file_info *fi,
+                      struct csc452_handle **handle, struct csc452_handle **own)
+{
+    *own = NULL;
+    if (fi != NULL && fi->fh != 0) {
+        *handle = (struct csc452_handle *) (uintptr_t) fi->fh;
+        return 0;
+    }
+
+    int res = path_handle(fs, path, own);
+    *handle = *own;
+    return res;
+}
+
+/**
+ * Reads the FAT region into memory and builds the free-block bitmap
+ */
+static int fat_load(struct csc452_fs *fs)
+{
+    fs->fat = malloc((size_t) fs->fatBlocks * fs->blockSize);
+    fs->fatDirty = calloc(fs->fatBlocks, 1);
+    fs->freeMap = calloc((fs->nBlocks + 63) / 64, sizeof(uint64_t));
+    if (fs->fat == NULL || fs->fatDirty == NULL || fs->freeMap == NULL) {
+        return -ENOMEM;
+    }
+
+    int res = disk_read(fs, fs->fat, (size_t) fs->fatBlocks * fs->blockSize,
+                        (off_t) fs->fatStart * fs->blockSize);
+    if (res != 0) {
+        return res;
+    }
+
+    // Only the data blocks between the root and the FAT are ever allocated
+    for (long i = fs->rootBlock + 1; i < fs->fatStart; i++) {
+        fat_mark(fs, i, fs->fat[i] == FAT_FREE);
+    }
+    fs->allocHint = fs->rootBlock + 1;
+    return 0;
+}
+
+/**
+ * Copies the FAT blocks marked kind into a batch, as sync_run gathers it.
+ * With img NULL they are only counted. The caller holds fatLock and
+ * clears fatDirty once they are copied.
+ * @return the number of blocks
+ */
+static long fat_copy(struct csc452_fs *fs, int kind, struct csc452_image *img, char **images)
+{
+    long n = 0;
+    for (long i = 0; i < fs->fatBlocks; i++) {
+        if (fs->fatDirty[i] != kind) {
+            continue;
+        }
+        if (img != NULL) {
+            memcpy(images[n], (char *) fs->fat + (size_t) i * fs->blockSize, fs->blockSize);
+            img[n].target = fs->fatStart + i;
+            img[n].dir = -1;
+            img[n].kind = kind;
+        }
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Gets the next available fat block. The search starts where the last one
+ * left off and skips 64 used entries at a time through the free bitmap.
+ * @return the block number, or -1 if the disk is full
+ */
+long get_fat_block(struct csc452_fs *fs)
+{
+    long words = (fs->nBlocks + 63) / 64;
+    long startWord = fs->allocHint / 64;
+
+    for (long n = 0; n <= words; n++) {
+        long word = (startWord + n) % words;
+        uint64_t bits = fs->freeMap[word];
+        // On the first word ignore entries before the hint
+        if (n == 0) {
+            bits &= ~(((uint64_t) 1 << (fs->allocHint % 64)) - 1);
+        }
+        if (bits != 0) {
+            long entry = word * 64 + __builtin_ctzll(bits);
+            fs->allocHint = entry;
+            return entry;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Finds the skip index entry closest to logical block index without going
+ * past it, extending the index along the chain as far as needed. The
+ * caller holds the node's lock.
+ * @param at set to the logical block number of the entry
+ * @return the entry's physical block
+ */
+static long skip_nearest(struct csc452_fs *fs, struct csc452_node *node, long index, long *at)
+{
+    long want = index / SKIP_STRIDE;
+
+    pthread_mutex_lock(&node->skipLock);
+    while (node->skipLen <= want) {
+        long block = node->startBlock;
+        if (node->skipLen > 0) {
+            block = node->skip[node->skipLen - 1];
+            for (int i = 0; i < SKIP_STRIDE && block != -1; i++) {
+                block = next_block(fs, block);
+            }
+            if (block == -1) {
+                break;
+            }
+        }
+
+        if (node->skipLen == node->skipCap) {
+            long cap = node->skipCap > 0 ? node->skipCap * 2 : 16;
+            long *skip = realloc(node->skip, cap * sizeof(long));
+            if (skip == NULL) {
+                break;
+            }
+            node->skip = skip;
+            node->skipCap = cap;
+        }
+        node->skip[node->skipLen++] = block;
+    }
+
+    long k = node->skipLen > 0 ? (want < node->skipLen ? want : node->skipLen - 1) : 0;
+    long block = node->skipLen > 0 ? node->skip[k] : node->startBlock;
+    pthread_mutex_unlock(&node->skipLock);
+
+    *at = k * SKIP_STRIDE;
+    return block;
+}
+
+/**
+ * Finds the physical block that holds logical block index of the handle's
+ * file. The walk starts from the cursor when it is at or shortly before
+ * index, so sequential access costs one FAT step per block, and otherwise
+ * from the nearest skip index entry. The caller holds the node's lock.
+ * @return the block, or -1 if the chain is shorter than that
+ */
+static long handle_seek(struct csc452_fs *fs, struct csc452_handle *handle, long index)
+{
+    pthread_mutex_lock(&handle->cursorLock);
+    // A cursor from before the chain was cut may point at freed blocks
+    if (handle->cursorCuts != handle->node->cuts) {
+        handle->cursorIndex = 0;
+        handle->cursorBlock = handle->node->startBlock;
+        handle->cursorCuts = handle->node->cuts;
+    }
+    long at = handle->cursorIndex;
+    long block = handle->cursorBlock;
+    pthread_mutex_unlock(&handle->cursorLock);
+
+    if (at > index || index - at >= SKIP_STRIDE) {
+        long skipAt;
+        long skipBlock = skip_nearest(fs, handle->node, index, &skipAt);
+        if (at > index || skipAt > at) {
+            at = skipAt;
+            block = skipBlock;
+        }
+    }
+    while (at < index && block != -1) {
+        block = next_block(fs, block);
+        at++;
+    }
+    return block;
+}
+
+/**
+ * Moves the handle's cursor to a block the caller just used
+ */
+static void handle_move(struct csc452_handle *handle, long index, long block)
+{
+    pthread_mutex_lock(&handle->cursorLock);
+    handle->cursorIndex = index;
+    handle->cursorBlock = block;
+    handle->cursorCuts = handle->node->cuts;
+    pthread_mutex_unlock(&handle->cursorLock);
+}
+
+
+/**
+ * Finds the first free FAT entry at or after entry, below limit
+ * @return the entry, or -1 if there is none
+ */
+static long next_free(struct csc452_fs *fs, long entry, long limit)
+{
+    while (entry < limit) {
+        uint64_t bits = fs->freeMap[entry / 64] >> (entry % 64);
+        if (bits != 0) {
+            entry += __builtin_ctzll(bits);
+            return entry < limit ? entry : -1;
+        }
+        entry += 64 - (entry % 64);
+    }
+    return -1;
+}
+
+/**
+ * Counts the free entries starting at entry, stopping at max
+ */
+static long free_run(struct csc452_fs *fs, long entry, long max)
+{
+    long len = 0;
+    while (len < max && entry + len < fs->fatStart &&
+           (fs->freeMap[(entry + len) / 64] >> ((entry + len) % 64)) & 1) {
+        len++;
+    }
+    return len;
+}
+
+/**
+ * Finds a run of up to want free blocks. A run starting at goal is taken
+ * if goal is free, so a growing file stays contiguous. Otherwise the first
+ * run of want blocks after the allocation hint is used, or failing that
+ * the longest run found. The blocks are not marked used here.
+ * @param got set to the length of the run
+ * @return the first block of the run, or -1 if the disk is full
+ */
+static long find_extent(struct csc452_fs *fs, long goal, long want, long *got)
+{
+    if (goal > fs->rootBlock && goal < fs->fatStart && (*got = free_run(fs, goal, want)) > 0) {
+        return goal;
+    }
+
+    long bestFirst = -1;
+    long bestLen = 0;
+    // Search from the hint to the end, then wrap around to the start
+    long ranges[2][2] = {{fs->allocHint, fs->fatStart}, {fs->rootBlock + 1, fs->allocHint}};
+    for (int r = 0; r < 2; r++) {
+        long entry = ranges[r][0];
+        while ((entry = next_free(fs, entry, ranges[r][1])) != -1) {
+            long len = free_run(fs, entry, want);
+            if (len >= want) {
+                *got = len;
+                return entry;
+            } else if (len > bestLen) {
+                bestFirst = entry;
+                bestLen = len;
+            }
+            entry += len;
+        }
+    }
+
+    *got = bestLen;
+    return bestFirst;
+}
+
+/**
+ * Makes sure a chain has at least count blocks, given that block is its
+ * have-th block. The caller holds the file's node lock for writing.
+ * Missing blocks are reserved as contiguous extents, placed right after
+ * the current last block when possible and rounded up to the prealloc
+ * window, and each extent is linked into the FAT in a single pass.
+ * @return 0 on success, -ENOSPC if the disk filled up
+ */
+static int grow_chain(struct csc452_fs *fs, long block, long have, long count)
+{
+    long next;
+    while (have < count && (next = next_block(fs, block)) != -1) {
+        block = next;
+        have++;
+    }
+
+    long need = count - have;
+    long want = need < fs->prealloc ? fs->prealloc : need;
+    int res = 0;
+    pthread_mutex_lock(&fs->fatLock);
+    while (need > 0) {
+        long got;
+        long first = find_extent(fs, block + 1, want, &got);
+        if (first == -1) {
+            res = -ENOSPC;
+            break;
+        }
+
+        // Link the tail to the extent and the extent blocks to each other
+        set_fat_block(fs, block, first);
+        for (long b = first; b < first + got; b++) {
+            set_fat_block(fs, b, b + 1 < first + got ? (uint32_t) b + 1 : FAT_EOC);
+        }
+        fs->allocHint = first + got;
+        block = first + got - 1;
+        need -= got;
+        want = want - got < need ? need : want - got;
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+    return res;
+}
+
+/**
+ * Takes a free block for a directory and links it into the directory's
+ * chain right after its first block, so growing never walks the chain
+ * @return the block, or -1 if the disk is full
+ */
+static long dir_alloc_block(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    pthread_mutex_lock(&fs->fatLock);
+    long block = get_fat_block(fs);
+    if (block != -1) {
+        set_fat_block(fs, block, fs->fat[dir->startBlock]);
+        set_fat_block(fs, dir->startBlock, block);
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+    return block;
+}
+
+/**
+ * Gives back the block dir_alloc_block handed out last
+ */
+static void dir_unalloc_block(struct csc452_fs *fs, struct csc452_dir_cache *dir, long block)
+{
+    pthread_mutex_lock(&fs->fatLock);
+    set_fat_block(fs, dir->startBlock, fs->fat[block]);
+    set_fat_block(fs, block, FAT_FREE);
+    pthread_mutex_unlock(&fs->fatLock);
+}
+
+/**
+ * Doubles a cached directory's table, each new slot sharing the bucket of
+ * the slot it mirrors. A table that outgrows the first block moves into
+ * blocks of its own, and after that grows by as many again.
+ * @return 0 on success, -ENOSPC if the table can't grow or the disk is
+ * full, or -ENOMEM
+ */
+static int grow_table(struct csc452_fs *fs, struct csc452_dir_cache *dir)
+{
+    uint32_t bs = fs->blockSize;
+    struct csc452_dir_header *head = dir->head;
+    unsigned n = dir_slots(dir);
+    if (head->depth >= dir_max_depth(bs)) {
+        return -ENOSPC;
+    }
+
+    // Every slot gets copied, so the whole table has to be in
+    long have = head->nTableBlocks;
+    long need = 2 * n > CSC452_DIR_INLINE_SLOTS(bs) ? 2 * n / CSC452_DIR_SLOTS_PER_BLOCK(bs) : 0;
+    for (long k = 0; k < have; k++) {
+        int res = table_load(fs, dir, k * CSC452_DIR_SLOTS_PER_BLOCK(bs));
+        if (res != 0) {
+            return res;
+        }
+    }
+    struct csc452_dir_bucket **slots = realloc(dir->slots, 2 * n * sizeof(struct csc452_dir_bucket *));
+    if (slots != NULL) {
+        dir->slots = slots;
+    }
+    char *data = need > have ? realloc(dir->tableData, (size_t) need * bs) : dir->tableData;
+    if (data != NULL) {
+        dir->tableData = data;
+    }
+    unsigned char *loaded = need > have ? realloc(dir->tableLoaded, need) : dir->tableLoaded;
+    if (loaded != NULL) {
+        dir->tableLoaded = loaded;
+    }
+    unsigned char *dirty = need > have ? realloc(dir->tableDirty, need) : dir->tableDirty;
+    if (dirty != NULL) {
+        dir->tableDirty = dirty;
+    }
+    long *blocks = malloc((need - have + 1) * sizeof(long));
+    if (slots == NULL || (need > have && (data == NULL || loaded == NULL || dirty == NULL)) || blocks == NULL) {
+        free(blocks);
+        return -ENOMEM;
+    }
+    for (long k = 0; k < need - have; k++) {
+        if ((blocks[k] = dir_alloc_block(fs, dir)) == -1) {
+            while (k-- > 0) {
+                dir_unalloc_block(fs, dir, blocks[k]);
+            }
+            free(blocks);
+            return -ENOSPC;
+        }
+    }
+
+    // Moving out of the first block, the table's slots make way for the
+    // list of its blocks
+    if (have == 0 && need > 0) {
+        memcpy(dir->tableData, head->table, n * sizeof(uint32_t));
+        memset(head->table, 0, n * sizeof(uint32_t));
+    }
+    if (need > 0) {
+        dir->table = (uint32_t *) dir->tableData;
+    }
+    for (long k = have; k < need; k++) {
+        head->table[k] = blocks[k - have];
+        dir->tableLoaded[k] = 1;
+        dir->tableDirty[k] = 1;
+    }
+    head->nTableBlocks = need;
+    free(blocks);
+
+    for (unsigned s = 0; s < n; s++) {
+        dir->table[n + s] = dir->table[s];
+        dir->slots[n + s] = dir->slots[s];
+    }
+    head->depth++;
+    table_dirty(fs, dir, n);
+    head_dirty(fs, dir);
+    return 0;
+}
+
+/**
+ * Splits a full bucket in two on the next bit of its names' hashes,
+ * doubling the table first if the bucket already has a slot to itself
+ * @param s a slot pointing at the bucket
+ * @return 0 on success, or negative errno
+ */
+static int split_bucket(struct csc452_fs *fs, struct csc452_dir_cache *dir, struct csc452_dir_bucket *bucket,
+                        unsigned s)
+{
+    uint32_t depth = bucket->data->depth;
+    int res = depth == dir->head->depth ? grow_table(fs, dir) : 0;
+    unsigned first = (s & ((1u << depth) - 1)) | (1u << depth);
+    for (unsigned t = first; res == 0 && t < dir_slots(dir); t += 2u << depth) {
+        res = table_load(fs, dir, t);
+    }
+    struct csc452_dir_bucket *other = res == 0 ? bucket_new(fs, 0) : NULL;
+    csc452_directory_entry *old = res == 0 ? malloc(fs->blockSize) : NULL;
+    if (res == 0 && (other == NULL || old == NULL)) {
+        res = -ENOMEM;
+    } else if (res == 0 && (other->block = dir_alloc_block(fs, dir)) == -1) {
+        res = -ENOSPC;
+    }
+    if (res != 0) {
+        free(old);
+        bucket_free(other);
+        return res;
+    }
+
+    // Both halves are packed again from a copy, names with the next bit set
+    // going to the new bucket
+    memcpy(old, bucket->data, fs->blockSize);
+    memset(bucket->data, 0, fs->blockSize);
+    for (int i = 0; i < old->nFiles; i++) {
+        struct csc452_file_directory *f = &old->files[i];
+        csc452_directory_entry *to = f->hash >> depth & 1 ? other->data : bucket->data;
+        struct csc452_file_directory *g = bucket_add(fs->blockSize, to, (const char *) old + f->nameOffset, f->nameLen);
+        g->fsize = f->fsize;
+        g->nStartBlock = f->nStartBlock;
+        g->type = f->type;
+    }
+    bucket->data->depth = other->data->depth = depth + 1;
+    free(old);
+    other->next = dir->buckets;
+    dir->buckets = other;
+
+    for (unsigned t = first; t < dir_slots(dir); t += 2u << depth) {
+        dir->table[t] = other->block;
+        dir->slots[t] = other;
+        table_dirty(fs, dir, t);
+    }
+    bucket_dirty(fs, dir, bucket);
+    bucket_dirty(fs, dir, other);
+    return 0;
+}
+
+/**
+ * Adds an entry to a cached directory, splitting its bucket while that is
+ * full. The caller holds the directory's lock for writing and has checked
+ * that the name isn't there.
+ * @return 0 on success, or negative errno
+ */
+static int add_entry(struct csc452_fs *fs, struct csc452_dir_cache *dir, const char *name, int type,
+                     long startBlock)
+{
+    size_t len = strlen(name);
+    uint32_t hash = name_hash(name, len);
+    struct csc452_dir_bucket *bucket;
+    int res;
+
+    for (;;) {
+        unsigned s = hash & (dir_slots(dir) - 1);
+        if ((res = dir_bucket(fs, dir, s, &bucket)) != 0) {
+            return res;
+        }
+        // The first entry of a directory brings its first bucket
+        if (bucket == NULL) {
+            if ((bucket = bucket_new(fs, 0)) == NULL) {
+                return -ENOMEM;
+            }
+            if ((bucket->block = dir_alloc_block(fs, dir)) == -1) {
+                bucket_free(bucket);
+                return -ENOSPC;
+            }
+            bucket->next = dir->buckets;
+            dir->buckets = bucket;
+            dir->table[s] = bucket->block;
+            dir->slots[s] = bucket;
+            table_dirty(fs, dir, s);
+        }
+        if (bucket_room(fs->blockSize, bucket->data) >= CSC452_ENTRY_BYTES(len)) {
+            break;
+        }
+        if ((res = split_bucket(fs, dir, bucket, s)) != 0) {
+            return res;
+        }
+    }
+
+    struct csc452_file_directory *f = bucket_add(fs->blockSize, bucket->data, name, len);
+    f->type = type;
+    f->nStartBlock = startBlock;
+    dir->head->nEntries++;
+    bucket_dirty(fs, dir, bucket);
+    head_dirty(fs, dir);
+    return 0;
+}
+
+/**
+ * Removes entry i from a bucket of a cached directory. The names packed
+ * below its name move up over it, and the bucket's last entry moves into
+ * its place; buckets stay even when they empty. The caller holds the
+ * directory's lock for writing.
+ */
+static void remove_entry(struct csc452_fs *fs, struct csc452_dir_cache *dir, struct csc452_dir_bucket *bucket,
+                         int i)
+{
+    csc452_directory_entry *data = bucket->data;
+    uint32_t names = fs->blockSize - data->nameBytes;
+    uint32_t offset = data->files[i].nameOffset;
+    uint32_t len = data->files[i].nameLen;
+    memmove((char *) data + names + len, (char *) data + names, offset - names);
+    memset((char *) data + names, 0, len);
+    data->nameBytes -= len;
+    for (int j = 0; j < data->nFiles; j++) {
+        if (data->files[j].nameOffset < offset) {
+            data->files[j].nameOffset += len;
+        }
+    }
+
+    int last = --data->nFiles;
+    if (i != last) {
+        data->files[i] = data->files[last];
+    }
+    memset(&data->files[last], 0, sizeof(struct csc452_file_directory));
+    dir->head->nEntries--;
+    bucket_dirty(fs, dir, bucket);
+    head_dirty(fs, dir);
+}
+
+/**
+ * Lays out a new filesystem covering the whole image: superblock, an empty
+ * root and journal header, and a FAT with the layout's blocks taken
+ */
+static int format_disk(struct csc452_fs *fs, off_t imageSize, int blockSize)
+{
+    csc452_superblock sb;
+    if (plan_superblock(&sb, imageSize, blockSize) != 0) {
+        return -EINVAL;
+    }
+
+    char *block = calloc(1, blockSize);
+    if (block == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(block, &sb, sizeof(sb));
+    int res = disk_write(fs, block, blockSize, 0);
+    memset(block, 0, blockSize);
+    if (res == 0) {
+        res = disk_write(fs, block, blockSize, (off_t) sb.rootBlock * blockSize);
+    }
+    if (res == 0 && sb.journalBlocks > 0) {
+        res = disk_write(fs, block, blockSize, (off_t) sb.journalStart * blockSize);
+    }
+
+    // Write the FAT a block at a time
+    uint32_t *entries = (uint32_t *) block;
+    long perBlock = blockSize / sizeof(uint32_t);
+    for (long i = 0; res == 0 && i < (long) sb.fatBlocks; i++) {
+        for (long e = 0; e < perBlock; e++) {
+            entries[e] = initial_fat_entry(&sb, i * perBlock + e);
+        }
+        res = disk_write(fs, block, blockSize, (off_t) (sb.fatStart + i) * blockSize);
+    }
+
+    free(block);
+    return res;
+}
+
+/**
+ * Reads the superblock and sets up the geometry. A blank image (all zeros in
+ * the first block) is formatted first with the requested block size.
+ */
+static int load_superblock(struct csc452_fs *fs, off_t imageSize)
+{
+    char first[MIN_BLOCK_SIZE];
+    csc452_superblock sb;
+    int res = disk_read(fs, first, sizeof(first), 0);
+    if (res != 0) {
+        return res;
+    }
+
+    memcpy(&sb, first, sizeof(sb));
+    if (memcmp(sb.magic, CSC452_MAGIC, sizeof(sb.magic)) != 0) {
+        for (size_t i = 0; i < sizeof(first); i++) {
+            if (first[i] != 0) {
+                fprintf(stderr, "csc452: %s is not a version %d image\n", fs->image, CSC452_VERSION);
+                return -EINVAL;
+            }
+        }
+        int blockSize = fs->blockSize ? fs->blockSize : DEFAULT_BLOCK_SIZE;
+        if (!valid_block_size(blockSize)) {
+            fprintf(stderr, "csc452: blocksize must be a power of two from %d to %d\n",
+                    MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+            return -EINVAL;
+        }
+        if ((res = format_disk(fs, imageSize, blockSize)) != 0 || (res = disk_read(fs, &sb, sizeof(sb), 0)) != 0) {
+            return res;
+        }
+    }
+
+    if (!check_superblock(&sb, imageSize)) {
+        fprintf(stderr, "csc452: the superblock in %s is damaged or from another version\n", fs->image);
+        return -EINVAL;
+    }
+    if (fs->blockSize != 0 && fs->blockSize != (int) sb.blockSize) {
+        fprintf(stderr, "csc452: %s was formatted with %u byte blocks, ignoring blocksize\n", fs->image,
+                sb.blockSize);
+    }
+
+    fs->blockSize = sb.blockSize;
+    fs->diskSize = sb.diskSize;
+    fs->nBlocks = sb.nBlocks;
+    fs->rootBlock = sb.rootBlock;
+    fs->fatStart = sb.fatStart;
+    fs->fatBlocks = sb.fatBlocks;
+    if (sb.features & CSC452_FEATURE_JOURNAL) {
+        fs->journalStart = sb.journalStart;
+        fs->journalBlocks = sb.journalBlocks;
+    }
+    return 0;
+}
+
+/**
+ * Describes the writes that put a batch's blocks in place, one per run of
+ * blocks that go next to each other
+ * @return the number of writes
+ */
+static int image_runs(struct csc452_fs *fs, struct csc452_image *img, char **images, long count,
+                      struct csc452_io *io, struct iovec *iov)
+{
+    int runs = 0;
+    for (long k = 0; k < count; k++) {
+        iov[k].iov_base = images[k];
+        iov[k].iov_len = fs->blockSize;
+        // io_sync takes up to 64 buffers at a time
+        if (runs > 0 && img[k].target == img[k - 1].target + 1 && io[runs - 1].iovcnt < 64) {
+            io[runs - 1].iovcnt++;
+            continue;
+        }
+        io[runs].write = 1;
+        io[runs].iov = &iov[k];
+        io[runs].iovcnt = 1;
+        io[runs].offset = (off_t) img[k].target * fs->blockSize;
+        runs++;
+    }
+    return runs;
+}
+
+/**
+ * Commits a batch of metadata writes through the journal. The block images
+ * are written to the journal behind a header listing where they belong,
+ * and only once that is durable are they written in place. The batch is
+ * one transaction whenever it fits. One that doesn't sends its first
+ * writes ahead in transactions of their own and keeps the last journal's
+ * worth together, so the caller puts what can go early first: FAT blocks
+ * that only took allocations, which a crash can leak but not corrupt,
+ * since no batch frees a block. The caller serializes commits.
+ * @return 0 on success, or negative errno
+ */
+static int journal_commit(struct csc452_fs *fs, struct csc452_image *img, char **images, long total)
+{
+    long cap = journal_capacity(fs->blockSize, fs->journalBlocks);
+    struct csc452_journal_header *header = calloc(1, fs->blockSize);
+    struct csc452_io *jio = malloc((cap + 1) * sizeof(struct csc452_io));
+    struct iovec *jiov = malloc((cap + 1) * sizeof(struct iovec));
+    int res = -ENOMEM;
+    if (header == NULL || jio == NULL || jiov == NULL) {
+        goto out;
+    }
+
+    res = 0;
+    long n;
+    for (long first = 0; first < total && res == 0; first += n) {
+        long left = total - first;
+        n = left <= cap ? left : left - cap < cap ? left - cap : cap;
+
+        // The journal is about to be overwritten, so the in-place writes of
+        // the last transaction have to be durable first
+        if (fs->checkpointed && (res = disk_sync(fs, 1)) != 0) {
+            break;
+        }
+        fs->checkpointed = 0;
+
+        memcpy(header->magic, CSC452_JOURNAL_MAGIC, sizeof(header->magic));
+        header->sequence = fs->journalSeq + 1;
+        header->nImages = n;
+        for (long k = 0; k < n; k++) {
+            header->targets[k] = img[first + k].target;
+        }
+        header->checksum = journal_checksum(header, images + first, fs->blockSize);
+
+        for (long k = 0; k <= n; k++) {
+            jiov[k].iov_base = k == 0 ? (char *) header : images[first + k - 1];
+            jiov[k].iov_len = fs->blockSize;
+            jio[k].write = 1;
+            jio[k].iov = &jiov[k];
+            jio[k].iovcnt = 1;
+            jio[k].offset = (off_t) (fs->journalStart + k) * fs->blockSize;
+        }
+        if ((res = disk_batch(fs, jio, n + 1, 0)) != 0 || (res = disk_sync(fs, 1)) != 0) {
+            break;
+        }
+        fs->journalSeq++;
+
+        // Committed; now the blocks can go where they belong
+        int runs = image_runs(fs, img + first, images + first, n, jio, jiov);
+        res = disk_batch(fs, jio, runs, 0);
+        fs->checkpointed = 1;
+    }
+
+out:
+    free(jiov);
+    free(jio);
+    free(header);
+    return res;
+}
+
+/**
+ * Replays the last transaction in the journal, if it is whole, by writing
+ * its images in place again. This runs on every mount; writing the same
+ * images a second time changes nothing, so there is no need to mark the
+ * journal empty after a checkpoint.
+ * @return 0 on success, or negative errno
+ */
+static int journal_replay(struct csc452_fs *fs)
+{
+    if (fs->journalBlocks == 0) {
+        return 0;
+    }
+
+    struct csc452_journal_header *header = malloc(fs->blockSize);
+    char *data = NULL;
+    char **images = NULL;
+    int res = header == NULL ? -ENOMEM : read_block(fs, header, fs->journalStart);
+    if (res != 0 || memcmp(header->magic, CSC452_JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->nImages == 0 || header->nImages > journal_capacity(fs->blockSize, fs->journalBlocks)) {
+        goto out;
+    }
+
+    uint32_t n = header->nImages;
+    data = malloc((size_t) n * fs->blockSize);
+    images = malloc(n * sizeof(char *));
+    if (data == NULL || images == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+    if ((res = disk_read(fs, data, (size_t) n * fs->blockSize, (off_t) (fs->journalStart + 1) * fs->blockSize)) != 0) {
+        goto out;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        images[i] = data + (size_t) i * fs->blockSize;
+        uint64_t t = header->targets[i];
+        if (t < (uint64_t) fs->rootBlock || t >= (uint64_t) fs->nBlocks ||
+            (t >= (uint64_t) fs->journalStart && t < (uint64_t) (fs->journalStart + fs->journalBlocks))) {
+            goto out;
+        }
+    }
+    // A torn transaction never reached its in-place writes; skip it
+    if (journal_checksum(header, images, fs->blockSize) != header->checksum) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < n && res == 0; i++) {
+        res = write_block(fs, images[i], header->targets[i]);
+    }
+    if (res == 0) {
+        res = disk_sync(fs, 1);
+    }
+    fs->journalSeq = header->sequence;
+
+out:
+    free(images);
+    free(data);
+    free(header);
+    return res;
+}
+
+/**
+ * Copies one block into a batch
+ */
+static void image_add(struct csc452_fs *fs, struct csc452_image *img, char *image, const void *block,
+                      long target, long dir)
+{
+    memcpy(image, block, fs->blockSize);
+    img->target = target;
+    img->dir = dir;
+    img->kind = 0;
+}
+
+/**
+ * Copies the blocks of a cached directory that differ from disk into a
+ * batch, as fat_copy does for the FAT. With img NULL they are only
+ * counted. The caller holds the directory's lock for writing and calls
+ * dir_clean once they are copied.
+ * @return the number of blocks
+ */
+static long dir_copy(struct csc452_fs *fs, struct csc452_dir_cache *dir, struct csc452_image *img, char **images)
+{
+    long n = 0;
+    size_t bs = fs->blockSize;
+    if (dir->headDirty) {
+        if (img != NULL) {
+            image_add(fs, &img[n], images[n], dir->head, dir->startBlock, dir->startBlock);
+        }
+        n++;
+    }
+    for (uint32_t k = 0; k < dir->head->nTableBlocks; k++) {
+        if (dir->tableDirty[k]) {
+            if (img != NULL) {
+                image_add(fs, &img[n], images[n], dir->tableData + k * bs, dir->head->table[k], dir->startBlock);
+            }
+            n++;
+        }
+    }
+    for (struct csc452_dir_bucket *b = dir->dirtyBuckets; b != NULL; b = b->dirtyNext) {
+        if (img != NULL) {
+            image_add(fs, &img[n], images[n], b->data, b->block, dir->startBlock);
+        }
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Marks a directory's block dirty again after the batch holding it failed.
+ * The block is found by number, since the directory may have changed
+ * since; a block it no longer has needs nothing. The caller holds the
+ * directory's lock for writing.
+ */
+static void dir_redirty(struct csc452_fs *fs, struct csc452_dir_cache *dir, long block)
+{
+    if (block == dir->startBlock) {
+        head_dirty(fs, dir);
+        return;
+    }
+    for (uint32_t k = 0; k < dir->head->nTableBlocks; k++) {
+        if (dir->head->table[k] == block) {
+            dir->tableDirty[k] = 1;
+            dir_queue(fs, dir);
+            return;
+        }
+    }
+    for (struct csc452_dir_bucket *b = dir->buckets; b != NULL; b = b->next) {
+        if (b->block == block) {
+            bucket_dirty(fs, dir, b);
+            return;
+        }
+    }
+}
+
+/**
+ * Marks everything in a cached directory as written
+ */
+static void dir_clean(struct csc452_dir_cache *dir)
+{
+    dir->headDirty = 0;
+    memset(dir->tableDirty, 0, dir->head->nTableBlocks);
+    while (dir->dirtyBuckets != NULL) {
+        dir->dirtyBuckets->dirty = 0;
+        dir->dirtyBuckets = dir->dirtyBuckets->dirtyNext;
+    }
+}
+
+static int dir_compare(const void *a, const void *b)
+{
+    long x = (*(struct csc452_dir_cache * const *) a)->startBlock;
+    long y = (*(struct csc452_dir_cache * const *) b)->startBlock;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Writes everything held back in memory to the image: cached file data
+ * first, then the FAT that links it, then directory blocks. The metadata
+ * goes through the journal when the image has one, and otherwise out as
+ * one linked batch in that order, so an entry never claims data or links
+ * that aren't on disk yet. Chains queued by free_chain before the batch
+ * was gathered are freed once it is committed.
+ *
+ * The batch is copied out with every dirty directory and the FAT locked,
+ * so it is one consistent picture, and written after they are let go.
+ * Whatever changes meanwhile is dirty again and waits for the next run.
+ * @return 0 on success, or the first negative errno
+ */
+static int sync_run(struct csc452_fs *fs)
+{
+    pthread_mutex_lock(&fs->cacheLock);
+    int res = cache_flush(fs);
+    pthread_mutex_unlock(&fs->cacheLock);
+
+    // Take the dirty directories, locked in block order, and the chains
+    // whose entries they drop
+    pthread_rwlock_rdlock(&fs->rootLock);
+    pthread_mutex_lock(&fs->dirLock);
+    int nDirs = 0;
+    for (struct csc452_dir_cache *dir = fs->dirtyDirs; dir != NULL; dir = dir->dirtyNext) {
+        nDirs++;
+    }
+    struct csc452_dir_cache **dirty = malloc((nDirs + 1) * sizeof(struct csc452_dir_cache *));
+    long *chains = NULL;
+    long nChains = 0;
+    if (dirty == NULL) {
+        nDirs = 0;
+    } else {
+        nDirs = 0;
+        for (struct csc452_dir_cache *dir = fs->dirtyDirs; dir != NULL; dir = dir->dirtyNext) {
+            dirty[nDirs++] = dir;
+        }
+        fs->dirtyDirs = NULL;
+        // Every entry these chains were taken from is in the batch
+        chains = fs->freeLater;
+        nChains = fs->nFreeLater;
+        fs->freeLater = NULL;
+        fs->nFreeLater = fs->freeLaterCap = 0;
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    qsort(dirty, nDirs, sizeof(struct csc452_dir_cache *), dir_compare);
+    long nDirty = 0;
+    for (int d = 0; d < nDirs; d++) {
+        pthread_rwlock_wrlock(&dirty[d]->lock);
+        nDirty += dir_copy(fs, dirty[d], NULL, NULL);
+    }
+    pthread_mutex_lock(&fs->fatLock);
+
+    // Allocations first, then cuts, then the directories
+    long early = fat_copy(fs, FAT_DIRTY, NULL, NULL);
+    long cuts = fat_copy(fs, FAT_DIRTY_CUT, NULL, NULL);
+    long count = early + cuts + nDirty;
+    struct csc452_image *img = malloc((count + 1) * sizeof(struct csc452_image));
+    char **images = malloc((count + 1) * sizeof(char *));
+    char *data = malloc((size_t) (count + 1) * fs->blockSize);
+    int err = -ENOMEM;
+    if (dirty != NULL && img != NULL && images != NULL && data != NULL) {
+        for (long k = 0; k < count; k++) {
+            images[k] = data + (size_t) k * fs->blockSize;
+        }
+        fat_copy(fs, FAT_DIRTY, img, images);
+        fat_copy(fs, FAT_DIRTY_CUT, img + early, images + early);
+        memset(fs->fatDirty, 0, fs->fatBlocks);
+        long k = early + cuts;
+        for (int d = 0; d < nDirs; d++) {
+            k += dir_copy(fs, dirty[d], img + k, images + k);
+            dir_clean(dirty[d]);
+        }
+        err = 0;
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+    pthread_mutex_lock(&fs->dirLock);
+    for (int d = 0; d < nDirs; d++) {
+        struct csc452_dir_cache *dir = dirty[d];
+        // Changes from here on queue it again. Without a batch it waits
+        // for the next run as it is.
+        if (err == 0) {
+            dir->queued = 0;
+        } else {
+            dir->dirtyNext = fs->dirtyDirs;
+            fs->dirtyDirs = dir;
+        }
+        pthread_rwlock_unlock(&dir->lock);
+    }
+    pthread_mutex_unlock(&fs->dirLock);
+    pthread_rwlock_unlock(&fs->rootLock);
+
+    if (err == 0 && count > 0) {
+        struct csc452_io *io = fs->journalBlocks > 0 ? NULL : malloc(count * sizeof(struct csc452_io));
+        struct iovec *iov = fs->journalBlocks > 0 ? NULL : malloc(count * sizeof(struct iovec));
+        if (fs->journalBlocks > 0) {
+            err = journal_commit(fs, img, images, count);
+        } else if (io == NULL || iov == NULL) {
+            err = -ENOMEM;
+        } else {
+            err = disk_batch(fs, io, image_runs(fs, img, images, count, io, iov), 1);
+        }
+        free(iov);
+        free(io);
+
+        // What didn't make it out is dirty again for the next run
+        if (err != 0) {
+            pthread_mutex_lock(&fs->fatLock);
+            for (long k = 0; k < early + cuts; k++) {
+                unsigned char *flag = &fs->fatDirty[img[k].target - fs->fatStart];
+                if (*flag < img[k].kind) {
+                    *flag = img[k].kind;
+                }
+            }
+            pthread_mutex_unlock(&fs->fatLock);
+            pthread_rwlock_rdlock(&fs->rootLock);
+            for (long k = early + cuts; k < count; k++) {
+                struct csc452_dir_cache *dir = dir_get(fs, img[k].dir, 0);
+                if (dir != NULL) {
+                    pthread_rwlock_wrlock(&dir->lock);
+                    if (dir->loaded) {
+                        dir_redirty(fs, dir, img[k].target);
+                    }
+                    pthread_rwlock_unlock(&dir->lock);
+                }
+            }
+            pthread_rwlock_unlock(&fs->rootLock);
+        }
+    }
+    res = res != 0 ? res : err;
+
+    if (err == 0) {
+        release_chains(fs, chains, nChains);
+    } else {
+        // Still needed by entries on disk; try again next time
+        for (long i = 0; i < nChains; i++) {
+            free_later(fs, chains[i]);
+        }
+    }
+    free(chains);
+    free(data);
+    free(images);
+    free(img);
+    free(dirty);
+    return res;
+}
+
+/**
+ * Runs sync_run as a group commit. Callers that arrive while one is running
+ * wait for it, and the first of them to wake runs the next one for all of
+ * them, so a burst of flushes costs a couple of commits.
+ * @return 0 on success, or negative errno
+ */
+static int sync_all(struct csc452_fs *fs)
+{
+    pthread_mutex_lock(&fs->syncLock);
+    // Any run that starts from now on covers our changes
+    long need = fs->syncStarted + 1;
+    while (fs->syncing && fs->syncDone < need) {
+        pthread_cond_wait(&fs->syncCond, &fs->syncLock);
+    }
+    if (fs->syncDone >= need) {
+        int res = fs->syncRes;
+        pthread_mutex_unlock(&fs->syncLock);
+        return res;
+    }
+    fs->syncing = 1;
+    fs->syncStarted++;
+    pthread_mutex_unlock(&fs->syncLock);
+
+    int res = sync_run(fs);
+
+    pthread_mutex_lock(&fs->syncLock);
+    fs->syncing = 0;
+    fs->syncDone = fs->syncStarted;
+    fs->syncRes = res;
+    pthread_cond_broadcast(&fs->syncCond);
+    pthread_mutex_unlock(&fs->syncLock);
+    return res;
+}
+
+/**
+ * Fills in the attributes of an entry, as getattr reports them and readdir
+ * passes them along with each name
+ */
+static void entry_stat(const struct csc452_file_directory *entry, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    if (entry->type == CSC452_TYPE_DIR) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 2;
+        stbuf->st_size = entry->fsize;
+    }
+}
+
+/**
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not.
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int csc452_getattr(const char *path, struct stat *stbuf)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    struct csc452_file_directory entry;
+
+    pthread_rwlock_rdlock(&fs->rootLock);
+    int res = lookup_path(fs, path, &entry);
+    pthread_rwlock_unlock(&fs->rootLock);
+    if (res != 0) {
+        return res;
+    }
+
+    // An open file's entry may be a write behind
+    off_t size = entry.type == CSC452_TYPE_DIR ? -1 : node_size(fs, entry.nStartBlock);
+    if (size >= 0) {
+        entry.fsize = size;
+    }
+    entry_stat(&entry, stbuf);
+    return 0;
+}
+
+/**
+ * Where an entry of a bucket comes in readdir's order
+ */
+struct csc452_dir_pos {
+    off_t pos;
+    int i;
+};
+
+static int pos_compare(const void *a, const void *b)
+{
+    off_t x = ((const struct csc452_dir_pos *) a)->pos, y = ((const struct csc452_dir_pos *) b)->pos;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Orders two names of a bucket that share a hash
+ */
+static int name_compare(struct csc452_dir_bucket *bucket, int i, int j)
+{
+    int li = bucket_entry(bucket, i)->nameLen, lj = bucket_entry(bucket, j)->nameLen;
+    int c = memcmp(bucket_name(bucket, i), bucket_name(bucket, j), li < lj ? li : lj);
+    return c != 0 ? c : li - lj;
+}
+
+/**
+ * Puts a bucket's entries in readdir's order, giving each its position.
+ * Positions come from the names alone, so they stay put while other
+ * entries come and go and buckets split.
+ */
+static void bucket_order(struct csc452_dir_bucket *bucket, struct csc452_dir_pos *pos)
+{
+    int n = bucket->data->nFiles;
+    for (int i = 0; i < n; i++) {
+        pos[i].pos = (off_t) hash_order(bucket_entry(bucket, i)->hash) << READDIR_SAME_BITS;
+        pos[i].i = i;
+    }
+    qsort(pos, n, sizeof(*pos), pos_compare);
+
+    // Names with the same hash are numbered in name order
+    int same = 0;
+    for (int i = 1; i < n; i++) {
+        if ((pos[i].pos >> READDIR_SAME_BITS) != (pos[i - 1].pos >> READDIR_SAME_BITS)) {
+            continue;
+        }
+        same = 1;
+        for (int j = i - 1; j >= 0 && (pos[j].pos >> READDIR_SAME_BITS) == (pos[i].pos >> READDIR_SAME_BITS); j--) {
+            if (name_compare(bucket, pos[j].i, pos[i].i) < 0) {
+                pos[i].pos++;
+            } else {
+                pos[j].pos++;
+            }
+        }
+    }
+    if (same) {
+        qsort(pos, n, sizeof(*pos), pos_compare);
+    }
+    for (int i = 0; i < n; i++) {
+        pos[i].pos += READDIR_FIRST;
+    }
+}
+
+/**
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int csc452_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    //Since we're building with -Wall (all warnings reported) we need
+    //to "use" every parameter, so let's just cast them to void to
+    //satisfy the compiler
+    (void) fi;
+
+    struct csc452_file_directory entry;
+    struct csc452_dir_cache *dir = NULL;
+    struct csc452_dir_pos *pos = malloc(CSC452_FILES_PER_DIR(fs->blockSize) * sizeof(struct csc452_dir_pos));
+
+    pthread_rwlock_rdlock(&fs->rootLock);
+    int res = pos == NULL ? -ENOMEM : lookup_path(fs, path, &entry);
+    if (res == 0 && entry.type != CSC452_TYPE_DIR) {
+        res = -ENOTDIR;
+    } else if (res == 0 && (dir = lock_directory(fs, entry.nStartBlock, 0)) == NULL) {
+        res = -EIO;
+    }
+    if (dir != NULL) {
+        //A directory holds two entries, one that represents itself (.)
+        //and one that represents the directory above us (..)
+        struct stat st;
+        entry_stat(&entry, &st);
+        int full = (offset < 1 && filler(buf, ".", &st, 1)) || (offset < 2 && filler(buf, "..", &st, 2));
+
+        // The rest go in hash_order, a bucket at a time, each bucket holding
+        // one run of that order; a later call picks up at the bucket holding
+        // offset. The offset passed with each name is where the next starts.
+        uint64_t order = offset > READDIR_FIRST ? (uint64_t) (offset - READDIR_FIRST) >> READDIR_SAME_BITS : 0;
+        while (!full && res == 0 && order <= UINT32_MAX) {
+            struct csc452_dir_bucket *bucket;
+            res = dir_bucket(fs, dir, hash_order(order) & (dir_slots(dir) - 1), &bucket);
+            if (res != 0 || bucket == NULL) {
+                break;
+            }
+            bucket_order(bucket, pos);
+            for (int k = 0; !full && k < bucket->data->nFiles; k++) {
+                if (pos[k].pos < offset) {
+                    continue;
+                }
+                // Names are kept without a nul
+                struct csc452_file_directory *f = bucket_entry(bucket, pos[k].i);
+                char name[MAX_NAME + 1];
+                memcpy(name, bucket_name(bucket, pos[k].i), f->nameLen);
+                name[f->nameLen] = '\0';
+                entry_stat(f, &st);
+                full = filler(buf, name, &st, pos[k].pos + 1);
+            }
+            uint32_t shift = 32 - bucket->data->depth;
+            order = ((order >> shift) + 1) << shift;
+        }
+        unlock_directory(dir);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+    free(pos);
+    return res;
+}
+
+/**
+ * Creates a directory anywhere in the tree. We can ignore mode since we're
+ * not dealing with permissions, as long as getattr returns appropriate
+ * ones for us.
+ */
+static int csc452_mkdir(const char *path, mode_t mode)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    (void) mode;
+
+    const char *last;
+    struct csc452_dir_cache *parent = NULL;
+    int res = 0;
+
+    pthread_rwlock_wrlock(&fs->rootLock);
+    long dirBlock = walk_path(fs, path, &last);
+    if (dirBlock < 0) {
+        res = dirBlock;
+    } else if (*last == '\0') {
+        res = -EEXIST;
+    } else if ((res = check_name(strlen(last))) == 0 && (parent = lock_directory(fs, dirBlock, 1)) == NULL) {
+        res = -EIO;
+    }
+    struct csc452_dir_bucket *bucket;
+    int i = parent != NULL ? find_file(fs, parent, last, strlen(last), &bucket) : -ENOENT;
+    if (i >= 0) {
+        res = -EEXIST;
+    } else if (i != -ENOENT) {
+        res = i;
+    } else if (parent != NULL) {
+        // Update FAT table to mark the directory's first block
+        pthread_mutex_lock(&fs->fatLock);
+        long blockPos = get_fat_block(fs);
+        if (blockPos != -1) {
+            set_fat_block(fs, blockPos, FAT_EOC);
+        }
+        pthread_mutex_unlock(&fs->fatLock);
+
+        // Create the directory straight into the cache, empty
+        struct csc452_dir_cache *newDir = blockPos != -1 ? dir_get(fs, blockPos, 1) : NULL;
+        if (blockPos == -1) {
+            res = -ENOSPC;
+        } else if (newDir == NULL || dir_make_empty(fs, newDir) != 0) {
+            res = -ENOMEM;
+        } else {
+            // Commit the new block, the parent and the FAT together
+            res = add_entry(fs, parent, last, CSC452_TYPE_DIR, blockPos);
+        }
+        if (res != 0 && blockPos != -1) {
+            if (newDir != NULL) {
+                dir_forget(fs, newDir);
+            }
+            pthread_mutex_lock(&fs->fatLock);
+            set_fat_block(fs, blockPos, FAT_FREE);
+            pthread_mutex_unlock(&fs->fatLock);
+        }
+    }
+    if (parent != NULL) {
+        unlock_directory(parent);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+    if (res == 0) {
+        res = sync_all(fs);
+    }
+    return res;
+}
+
+/**
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ * Note that the mknod shell command is not the one to test this.
+ * mknod at the shell is used to create "special" files and we are
+ * only supporting regular files.
+ *
+ */
+static int csc452_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    (void) mode;
+    (void) dev;
+
+    const char *last;
+    struct csc452_dir_cache *dir = NULL;
+    int res = 0;
+
+    pthread_rwlock_rdlock(&fs->rootLock);
+    long dirBlock = walk_path(fs, path, &last);
+    if (dirBlock < 0) {
+        res = dirBlock;
+    } else if (*last == '\0') {
+        res = -EPERM;
+    } else if ((res = check_name(strlen(last))) == 0 && (dir = lock_directory(fs, dirBlock, 1)) == NULL) {
+        res = -EIO;
+    }
+    struct csc452_dir_bucket *bucket;
+    int i = dir != NULL ? find_file(fs, dir, last, strlen(last), &bucket) : -ENOENT;
+    if (i >= 0) {
+        res = -EEXIST;
+    } else if (i != -ENOENT) {
+        res = i;
+    } else if (dir != NULL) {
+        //Update FAT table to mark the file location
+        pthread_mutex_lock(&fs->fatLock);
+        long blockPos = get_fat_block(fs);
+        if (blockPos != -1) {
+            set_fat_block(fs, blockPos, FAT_EOC);
+        }
+        pthread_mutex_unlock(&fs->fatLock);
+
+        //Commit the entry with the FAT
+        if (blockPos == -1) {
+            res = -ENOSPC;
+        } else if ((res = add_entry(fs, dir, last, CSC452_TYPE_FILE, blockPos)) != 0) {
+            pthread_mutex_lock(&fs->fatLock);
+            set_fat_block(fs, blockPos, FAT_FREE);
+            pthread_mutex_unlock(&fs->fatLock);
+        }
+    }
+    if (dir != NULL) {
+        unlock_directory(dir);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+    if (res == 0) {
+        res = sync_all(fs);
+    }
+
+    // return result
+    return res;
+}
+
+/**
+ * Writes back what a handle wrote, if anything, since the last time
+ * @return 0 on success, or negative errno
+ */
+static int sync_handle(struct csc452_fs *fs, struct csc452_handle *handle)
+{
+    pthread_rwlock_wrlock(&handle->node->lock);
+    int wrote = handle->wrote;
+    handle->wrote = 0;
+    pthread_rwlock_unlock(&handle->node->lock);
+
+    return wrote ? sync_all(fs) : 0;
+}
+
+/**
+ * Reads size bytes starting at offset from the handle's file. The FAT is
+ * used to group the chain into runs of physically adjacent blocks and each
+ * run is read straight into buf, with one pread per stretch that isn't in
+ * the cache. The caller holds the node's lock.
+ * @return the number of bytes read, or negative errno
+ */
+static int read_chain(struct csc452_fs *fs, struct csc452_handle *handle, char *buf, size_t size, off_t offset)
+{
+    size_t skip = offset % fs->blockSize;
+    size_t done = 0;
+    long index = offset / fs->blockSize;
+    long block = handle_seek(fs, handle, index);
+    long last = -1;
+
+    while (done < size && block != -1) {
+        // Extend the run while the next block in the chain is the next on disk
+        long first = block;
+        size_t runBytes = fs->blockSize - skip;
+        while (done + runBytes < size && next_block(fs, block) == block + 1) {
+            block++;
+            runBytes += fs->blockSize;
+        }
+        if (done + runBytes > size) {
+            runBytes = size - done;
+        }
+
+        int res = cache_read(fs, buf + done, first, skip, runBytes);
+        if (res != 0) {
+            return done > 0 ? (int) done : res;
+        }
+        done += runBytes;
+        skip = 0;
+        index += block - first;
+        last = block;
+        if (done < size && (block = next_block(fs, block)) != -1) {
+            index++;
+        }
+    }
+
+    // Leave the cursor on the last block read for the next sequential read
+    if (last != -1) {
+        handle_move(handle, index, last);
+    }
+    return done;
+}
+
+/**
+ * Finds the first block of a read-ahead request. Nothing past the end of
+ * the file is worth reading, and a chain cut since the request was queued
+ * may no longer hold the blocks it names. The caller holds the node's lock.
+ * @return the block, or -1 if there is nothing to read; count is set to
+ * the blocks to read from there
+ */
+static long readahead_seek(struct csc452_fs *fs, struct csc452_readahead *ra, long *count)
+{
+    struct csc452_node *node = ra->node;
+    long blocks = (node->size + fs->blockSize - 1) / fs->blockSize;
+    *count = ra->index + ra->count > blocks ? blocks - ra->index : ra->count;
+    if (ra->cuts != node->cuts || *count <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->fatLock);
+    long block = ra->block;
+    for (long at = ra->known; at < ra->index && block != -1; at++) {
+        block = next_block(fs, block);
+    }
+    pthread_mutex_unlock(&fs->fatLock);
+    return block;
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Brings count blocks of a file in ahead of the reader. read_buf hands the
+ * kernel segments of the image descriptor and takes only dirty blocks from
+ * the cache, so blocks read into the cache would never be served. Instead
+ * the kernel is asked to page in each run of adjacent blocks, which is
+ * where read_buf's segments are read from.
+ */
+static void readahead_fill(struct csc452_fs *fs, struct csc452_readahead *ra)
+{
+    struct csc452_node *node = ra->node;
+    long maxRun = RA_MAX_BYTES / fs->blockSize;
+
+    pthread_rwlock_rdlock(&node->lock);
+    long count;
+    long block = readahead_seek(fs, ra, &count);
+
+    while (count > 0 && block != -1) {
+        long first = block;
+        long n = 0;
+        pthread_mutex_lock(&fs->fatLock);
+        while (n < count && n < maxRun && block == first + n) {
+            n++;
+            block = next_block(fs, block);
+        }
+        pthread_mutex_unlock(&fs->fatLock);
+        posix_fadvise(fs->fd, (off_t) first * fs->blockSize, (off_t) n * fs->blockSize, POSIX_FADV_WILLNEED);
+        count -= n;
+    }
+    pthread_rwlock_unlock(&node->lock);
+}
+#else
+/**
+ * Reads count blocks of a file into the cache, skipping any that are there
+ * already, with one pread per run of adjacent blocks
+ */
+static void readahead_fill(struct csc452_fs *fs, struct csc452_readahead *ra, char *buf)
+{
+    struct csc452_node *node = ra->node;
+    long maxRun = RA_MAX_BYTES / fs->blockSize;
+
+    pthread_rwlock_rdlock(&node->lock);
+    long count;
+    long block = readahead_seek(fs, ra, &count);
+
+    while (count > 0 && block != -1) {
+        // Gather a run of adjacent blocks that aren't cached
+        long first = block;
+        long n = 0;
+        pthread_mutex_lock(&fs->fatLock);
+        pthread_mutex_lock(&fs->cacheLock);
+        while (n < count && n < maxRun && block == first + n && cache_find(fs, block) == -1) {
+            n++;
+            block = next_block(fs, block);
+        }
+        pthread_mutex_unlock(&fs->cacheLock);
+        if (n == 0) {
+            block = next_block(fs, block);
+        }
+        pthread_mutex_unlock(&fs->fatLock);
+        if (n == 0) {
+            count--;
+            continue;
+        }
+
+        if (disk_read(fs, buf, (size_t) n * fs->blockSize, (off_t) first * fs->blockSize) != 0) {
+            break;
+        }
+        // The file can't be written while we hold its lock, so these are
+        // still the blocks' contents
+        pthread_mutex_lock(&fs->cacheLock);
+        for (long b = 0; b < n; b++) {
+            if (cache_find(fs, first + b) == -1) {
+                int i = cache_get(fs, first + b, 0);
+                if (i < 0) {
+                    break;
+                }
+                memcpy(cache_data(fs, i), buf + b * fs->blockSize, fs->blockSize);
+            }
+        }
+        pthread_mutex_unlock(&fs->cacheLock);
+        count -= n;
+    }
+    pthread_rwlock_unlock(&node->lock);
+}
+#endif
+
+/**
+ * Body of a read-ahead thread: takes queued requests until unmount
+ */
+static void *readahead_thread(void *arg)
+{
+    struct csc452_fs *fs = arg;
+#if FUSE_VERSION < 29
+    char *buf = malloc(RA_MAX_BYTES);
+#endif
+
+    pthread_mutex_lock(&fs->raLock);
+    while (!fs->raStop) {
+        if (fs->raCount == 0) {
+            pthread_cond_wait(&fs->raCond, &fs->raLock);
+            continue;
+        }
+        struct csc452_readahead ra = fs->raQueue[fs->raHead];
+        fs->raHead = (fs->raHead + 1) % RA_QUEUE;
+        fs->raCount--;
+        pthread_mutex_unlock(&fs->raLock);
+
+#if FUSE_VERSION >= 29
+        readahead_fill(fs, &ra);
+#else
+        if (buf != NULL) {
+            readahead_fill(fs, &ra, buf);
+        }
+#endif
+        node_put(fs, ra.node);
+        pthread_mutex_lock(&fs->raLock);
+    }
+    pthread_mutex_unlock(&fs->raLock);
+
+#if FUSE_VERSION < 29
+    free(buf);
+#endif
+    return NULL;
+}
+
+/**
+ * Starts the read-ahead threads unless -o noreadahead was given. Without
+ * them reads simply go to disk.
+ */
+static void readahead_start(struct csc452_fs *fs)
+{
+    if (fs->noReadahead) {
+        return;
+    }
+    for (int i = 0; i < RA_THREADS; i++) {
+        if (pthread_create(&fs->raThreads[i], NULL, readahead_thread, fs) != 0) {
+            break;
+        }
+        fs->raStarted++;
+    }
+}
+
+/**
+ * Stops the read-ahead threads and drops requests they didn't get to
+ */
+static void readahead_stop(struct csc452_fs *fs)
+{
+    pthread_mutex_lock(&fs->raLock);
+    fs->raStop = 1;
+    pthread_cond_broadcast(&fs->raCond);
+    pthread_mutex_unlock(&fs->raLock);
+    for (int i = 0; i < fs->raStarted; i++) {
+        pthread_join(fs->raThreads[i], NULL);
+    }
+    fs->raStarted = 0;
+
+    for (; fs->raCount > 0; fs->raCount--) {
+        node_put(fs, fs->raQueue[fs->raHead].node);
+        fs->raHead = (fs->raHead + 1) % RA_QUEUE;
+    }
+}
+
+/**
+ * Watches the reads through a handle for a sequential pattern. Each read
+ * that starts where the last one ended doubles the read-ahead window and
+ * any other read quarters it. When the blocks already queued run within
+ * half a window of the reader, the next window's worth is queued. Called
+ * right after a read of size bytes at offset, with the node's lock held.
+ */
+static void readahead(struct csc452_fs *fs, struct csc452_handle *handle, off_t offset, size_t size)
+{
+    long maxWindow = RA_MAX_BYTES / fs->blockSize;
+    long minWindow = RA_MIN_BYTES / fs->blockSize;
+    struct csc452_readahead ra;
+    int queue = 0;
+
+    if (fs->raStarted == 0 || size == 0) {
+        return;
+    }
+    if (maxWindow > fs->cacheBlocks / 4) {
+        maxWindow = fs->cacheBlocks / 4;
+    }
+    if (minWindow > maxWindow) {
+        minWindow = maxWindow;
+    }
+
+    long last = (offset + size - 1) / fs->blockSize;
+    pthread_mutex_lock(&handle->cursorLock);
+    if (offset == handle->nextOffset) {
+        long window = handle->raWindow > 0 ? handle->raWindow * 2 : minWindow;
+        handle->raWindow = window < maxWindow ? window : maxWindow;
+    } else {
+        handle->raWindow /= 4;
+        handle->raEnd = last;
+    }
+    handle->nextOffset = offset + size;
+
+    long from = handle->raEnd > last ? handle->raEnd + 1 : last + 1;
+    long until = last + handle->raWindow;
+    if (handle->raWindow > 0 && until - from + 1 >= (handle->raWindow + 1) / 2) {
+        ra.node = handle->node;
+        ra.cuts = handle->cursorCuts;
+        ra.known = handle->cursorIndex;
+        ra.block = handle->cursorBlock;
+        ra.index = from;
+        ra.count = until - from + 1;
+        handle->raEnd = until;
+        queue = ra.known <= from;
+    }
+    pthread_mutex_unlock(&handle->cursorLock);
+    if (!queue) {
+        return;
+    }
+
+    // A full queue means the threads are behind; this window is dropped
+    node_hold(fs, ra.node);
+    pthread_mutex_lock(&fs->raLock);
+    if (fs->raCount < RA_QUEUE) {
+        fs->raQueue[(fs->raHead + fs->raCount) % RA_QUEUE] = ra;
+        fs->raCount++;
+        pthread_cond_signal(&fs->raCond);
+        ra.node = NULL;
+    }
+    pthread_mutex_unlock(&fs->raLock);
+    if (ra.node != NULL) {
+        node_put(fs, ra.node);
+    }
+}
+
+/**
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int csc452_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    //check to make sure path exists
+    //check that size is > 0
+    //check that offset is <= to the file size
+    //read in data
+    //return success, or error
+    struct csc452_handle *handle;
+    struct csc452_handle *own;
+    int res = get_handle(fs, path, fi, &handle, &own);
+    if (res != 0) {
+        return res;
+    }
+    struct csc452_node *node = handle->node;
+
+    pthread_rwlock_rdlock(&node->lock);
+    // Nothing to read at or past the end of the file
+    if (offset >= node->size) {
+        res = 0;
+    } else {
+        if (offset + (off_t) size > node->size) {
+            size = node->size - offset;
+        }
+        res = read_chain(fs, handle, buf, size, offset);
+        if (res > 0) {
+            readahead(fs, handle, offset, res);
+        }
+    }
+    pthread_rwlock_unlock(&node->lock);
+
+    if (own != NULL) {
+        close_handle(fs, own);
+    }
+    return res;
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Adds n bytes that start skip bytes into block to a bufvec. Bytes still
+ * only in the cache are copied into a buffer of their own; the rest become
+ * (fd, offset, length) segments, merged while they stay adjacent on disk.
+ * @return 0 on success, -ENOMEM
+ */
+static int bufvec_block(struct csc452_fs *fs, struct fuse_bufvec **vec, size_t *cap, long block, size_t skip, size_t n)
+{
+    off_t pos = (off_t) block * fs->blockSize + skip;
+    char *copy = NULL;
+    int dirty = 0;
+
+    pthread_mutex_lock(&fs->cacheLock);
+    int i = fs->nDirty > 0 ? cache_find(fs, block) : -1;
+    if (i != -1 && fs->cache[i].dirty) {
+        dirty = 1;
+        if ((copy = malloc(n)) != NULL) {
+            memcpy(copy, cache_data(fs, i) + skip, n);
+        }
+    }
+    pthread_mutex_unlock(&fs->cacheLock);
+    if (dirty && copy == NULL) {
+        return -ENOMEM;
+    }
+
+    struct fuse_buf *last = (*vec)->count > 0 ? &(*vec)->buf[(*vec)->count - 1] : NULL;
+    if (!dirty && last != NULL && (last->flags & FUSE_BUF_IS_FD) &&
+        last->pos + (off_t) last->size == pos) {
+        last->size += n;
+        return 0;
+    }
+
+    if ((*vec)->count == *cap) {
+        size_t newCap = *cap * 2;
+        struct fuse_bufvec *grown = realloc(*vec, sizeof(struct fuse_bufvec) +
+                                                  (newCap - 1) * sizeof(struct fuse_buf));
+        if (grown == NULL) {
+            free(copy);
+            return -ENOMEM;
+        }
+        *vec = grown;
+        *cap = newCap;
+    }
+    struct fuse_buf *buf = &(*vec)->buf[(*vec)->count++];
+    memset(buf, 0, sizeof(*buf));
+    buf->size = n;
+    if (dirty) {
+        buf->mem = copy;
+    } else {
+        buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->fd = fs->fd;
+        buf->pos = pos;
+    }
+    return 0;
+}
+
+/**
+ * Describes size bytes at offset of the handle's file as a bufvec, one
+ * segment per run of adjacent blocks, without reading the data. The caller
+ * holds the node's lock.
+ * @return 0 on success, or negative errno
+ */
+static int read_chain_buf(struct csc452_fs *fs, struct csc452_handle *handle, struct fuse_bufvec **vec, size_t *cap,
+                          size_t size, off_t offset)
+{
+    size_t skip = offset % fs->blockSize;
+    size_t done = 0;
+    long index = offset / fs->blockSize;
+    long block = handle_seek(fs, handle, index);
+    long last = -1;
+
+    while (done < size && block != -1) {
+        size_t n = fs->blockSize - skip;
+        if (n > size - done) {
+            n = size - done;
+        }
+        int res = bufvec_block(fs, vec, cap, block, skip, n);
+        if (res != 0) {
+            return res;
+        }
+        done += n;
+        skip = 0;
+        last = block;
+        if (done < size && (block = next_block(fs, block)) != -1) {
+            index++;
+        }
+    }
+
+    if (last != -1) {
+        handle_move(handle, index, last);
+    }
+    return 0;
+}
+
+/**
+ * Read size bytes from file starting from offset as segments of the image
+ * descriptor, so FUSE can splice them to the kernel without copying them
+ * through our buffers.
+ *
+ * FUSE reads the segments after this returns and the node's lock is let
+ * go. A write in that window can show through, as it could on any file
+ * read without a lock. Blocks a truncate cuts off in that window are held
+ * by truncate_free until the file is released, so they aren't reused while
+ * the reply may still name them. A read without an open file has nothing
+ * keeping its blocks past the return and isn't covered.
+ */
+static int csc452_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                           off_t offset, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    struct csc452_handle *handle;
+    struct csc452_handle *own;
+    int res = get_handle(fs, path, fi, &handle, &own);
+    if (res != 0) {
+        return res;
+    }
+    struct csc452_node *node = handle->node;
+
+    size_t cap = 8;
+    struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec) + (cap - 1) * sizeof(struct fuse_buf));
+    if (vec == NULL) {
+        res = -ENOMEM;
+    } else {
+        *vec = (struct fuse_bufvec) FUSE_BUFVEC_INIT(0);
+        vec->count = 0;
+
+        pthread_rwlock_rdlock(&node->lock);
+        // Nothing to read at or past the end of the file
+        if (offset < node->size) {
+            if (offset + (off_t) size > node->size) {
+                size = node->size - offset;
+            }
+            res = read_chain_buf(fs, handle, &vec, &cap, size, offset);
+            if (res == 0) {
+                readahead(fs, handle, offset, size);
+                pthread_mutex_lock(&node->skipLock);
+                node->spliced = 1;
+                pthread_mutex_unlock(&node->skipLock);
+            }
+        }
+        pthread_rwlock_unlock(&node->lock);
+
+        if (res != 0) {
+            for (size_t i = 0; i < vec->count; i++) {
+                free(vec->buf[i].mem);
+            }
+            free(vec);
+        } else {
+            // An empty read is one empty memory segment
+            if (vec->count == 0) {
+                vec->count = 1;
+            }
+            *bufp = vec;
+        }
+    }
+
+    if (own != NULL) {
+        close_handle(fs, own);
+    }
+    return res;
+}
+#endif
+
+/**
+ * Writes size bytes at offset into the handle's file, growing its chain and
+ * size as needed. Every block is reserved up front in one pass over the
+ * FAT. Partial blocks and short runs are merged into the cache, while long
+ * runs of adjacent whole blocks are written straight to disk with one
+ * write per run. The caller holds the node's lock for writing.
+ * @return 0 on success, or negative errno
+ */
+static int write_chain(struct csc452_fs *fs, struct csc452_handle *handle, struct csc452_source *src,
+                       size_t size, off_t offset)
+{
+    struct csc452_node *node = handle->node;
+
+    // Error check
+    if (offset > node->size) {
+        return -EFBIG;
+    } else if (size == 0) {
+        return 0;
+    }
+
+    // Reserve every block the write needs before copying anything, growing
+    // from the block that holds offset, or the last block if offset is the
+    // end of a chain that ends on a block boundary
+    long index = offset / fs->blockSize;
+    long from = index;
+    long block = handle_seek(fs, handle, from);
+    if (block == -1) {
+        block = handle_seek(fs, handle, --from);
+    }
+    int err = grow_chain(fs, block, from + 1, (offset + size + fs->blockSize - 1) / fs->blockSize);
+    if (err != 0) {
+        return err;
+    }
+    if (from != index) {
+        block = next_block(fs, block);
+    }
+
+    size_t done = 0;
+    size_t beginWriting = offset % fs->blockSize;
+    while (done < size) {
+        size_t n = fs->blockSize - beginWriting;
+        if (n > size - done) {
+            n = size - done;
+        }
+
+        // Measure the run of whole blocks that are adjacent on disk
+        long first = block;
+        size_t runBytes = n;
+        if (n == (size_t) fs->blockSize) {
+            long last = block;
+            while (done + runBytes + fs->blockSize <= size && next_block(fs, last) == last + 1) {
+                last++;
+                runBytes += fs->blockSize;
+            }
+            if (runBytes >= DIRECT_WRITE_BYTES) {
+                n = runBytes;
+                index += last - block;
+                block = last;
+            }
+        }
+
+        if (n >= DIRECT_WRITE_BYTES) {
+            cache_drop(fs, first, block - first + 1);
+            err = source_write(fs, src, n, (off_t) first * fs->blockSize);
+        } else {
+            // Merge into the cached copy; it reaches the disk on write-back
+            err = cache_write(fs, block, src, beginWriting, n);
+        }
+        if (err != 0) {
+            break;
+        }
+
+        done += n;
+        beginWriting = 0;
+        if (done < size) {
+            block = next_block(fs, block);
+            index++;
+        }
+    }
+    handle_move(handle, index, block);
+
+    if (err == 0 && offset + (off_t) size > node->size) {
+        node->size = offset + size;
+    }
+    return err;
+}
+
+/**
+ * Writes size bytes from src into file starting from offset, then updates
+ * the directory entry once if the file grew
+ * @return size on success, or negative errno
+ */
+static int write_source(struct csc452_fs *fs, const char *path, struct csc452_source *src, size_t size,
+                        off_t offset, struct fuse_file_info *fi)
+{
+    size_t res = size;
+    size_t fileSize = 0;
+
+    struct csc452_handle *handle;
+    struct csc452_handle *own;
+    int err = get_handle(fs, path, fi, &handle, &own);
+    if (err != 0) {
+        return err;
+    }
+    struct csc452_node *node = handle->node;
+
+    pthread_rwlock_wrlock(&node->lock);
+    fileSize = node->size;
+    err = write_chain(fs, handle, src, size, offset);
+    handle->wrote = 1;
+    pthread_rwlock_unlock(&node->lock);
+
+    // Update the file size
+    if (err == 0 && offset + size > fileSize) {
+        err = update_file_size(fs, handle);
+    }
+    if (err != 0) {
+        node_stale(fs, node->startBlock);
+    }
+    if (own != NULL) {
+        sync_all(fs);
+        close_handle(fs, own);
+    }
+
+    return err != 0 ? err : (int) res;
+}
+
+/**
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int csc452_write(const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    struct csc452_source src = {buf, NULL};
+    return write_source(fs, path, &src, size, offset, fi);
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Write the bytes of a bufvec into file starting from offset. The data is
+ * copied or spliced by fuse_buf_copy straight to where it belongs.
+ */
+static int csc452_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    struct csc452_source src = {NULL, buf};
+    return write_source(fs, path, &src, fuse_buf_size(buf), offset, fi);
+}
+#endif
+
+/**
+ * Called once when the filesystem is mounted. Opens the disk image and keeps
+ * the descriptor for every later operation, and tells the kernel how to
+ * size its requests.
+ */
+static void *csc452_init(struct fuse_conn_info *conn)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    struct stat st;
+
+    fs->fd = open(fs->image, O_RDWR);
+    if (fs->fd < 0 || fstat(fs->fd, &st) != 0) {
+        fprintf(stderr, "csc452: cannot use %s: %s\n", fs->image, strerror(errno));
+        fuse_exit(fuse_get_context()->fuse);
+        return fs;
+    }
+
+    // Map the image once its geometry is known; the FAT is read through it
+    int res = load_superblock(fs, st.st_size);
+    if (res == 0 && fs->useMmap) {
+        disk_map(fs);
+    }
+    // Finish the last metadata transaction before anything reads metadata
+    if (res == 0) {
+        res = journal_replay(fs);
+    }
+    if (fs->useUring) {
+#ifdef HAVE_LIBURING
+        if (pthread_key_create(&fs->ringKey, ring_free) != 0) {
+            fs->useUring = 0;
+        }
+#else
+        fprintf(stderr, "csc452: built without liburing, ignoring -o uring\n");
+        fs->useUring = 0;
+#endif
+    }
+    if (res == 0) {
+        fs->staleMap = calloc((fs->nBlocks + 63) / 64, sizeof(uint64_t));
+    }
+    if (res != 0 || fs->staleMap == NULL || fat_load(fs) != 0 || cache_init(fs) != 0) {
+        fprintf(stderr, "csc452: cannot mount %s\n", fs->image);
+        fuse_exit(fuse_get_context()->fuse);
+        return fs;
+    }
+    readahead_start(fs);
+
+#if FUSE_VERSION >= 28
+    // Otherwise the kernel sends writes a page at a time
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+#endif
+    // Big writes in whole blocks, which write_chain can send around the cache
+    if (conn->max_write > MAX_WRITE_BYTES) {
+        conn->max_write = MAX_WRITE_BYTES;
+    }
+    if (conn->max_write >= (unsigned) fs->blockSize) {
+        conn->max_write -= conn->max_write % fs->blockSize;
+    }
+
+    // Read the root now, so a damaged one stops the mount
+    struct csc452_dir_cache *root = dir_get(fs, fs->rootBlock, 1);
+    res = root == NULL ? -ENOMEM : 0;
+    if (root != NULL) {
+        pthread_rwlock_wrlock(&root->lock);
+        if (!root->loaded) {
+            res = load_directory(fs, root);
+        }
+        pthread_rwlock_unlock(&root->lock);
+    }
+    if (res != 0) {
+        fprintf(stderr, "csc452: cannot read the root directory of %s: %s\n", fs->image, strerror(-res));
+        fuse_exit(fuse_get_context()->fuse);
+        return fs;
+    }
+
+    return fs;
+}
+
+/**
+ * Called once when the filesystem is unmounted
+ */
+static void csc452_destroy(void *private_data)
+{
+    struct csc452_fs *fs = private_data;
+
+    readahead_stop(fs);
+    if (fs->fd >= 0) {
+        // The second run writes the FAT that frees the chains the first
+        // one committed the removal of
+        if (fs->fat != NULL && fs->cache != NULL && sync_all(fs) == 0) {
+            sync_all(fs);
+        }
+        if (fs->map != NULL) {
+            disk_sync(fs, 0);
+            munmap(fs->map, fs->diskSize);
+            fs->map = NULL;
+        }
+#ifdef HAVE_LIBURING
+        // Rings of other threads went away with the threads
+        if (fs->useUring) {
+            struct io_uring *ring = pthread_getspecific(fs->ringKey);
+            if (ring != NULL) {
+                ring_free(ring);
+            }
+            pthread_key_delete(fs->ringKey);
+            fs->useUring = 0;
+        }
+#endif
+        close(fs->fd);
+        fs->fd = -1;
+    }
+
+    for (int b = 0; b < DIR_BUCKETS; b++) {
+        while (fs->dirTable[b] != NULL) {
+            dir_forget(fs, fs->dirTable[b]);
+        }
+    }
+    free(fs->freeLater);
+    free(fs->staleMap);
+    free(fs->freeMap);
+    free(fs->fatDirty);
+    free(fs->fat);
+    free(fs->cacheOrder);
+    free(fs->cacheIov);
+    free(fs->cacheIo);
+    free(fs->cacheData);
+    free(fs->cache);
+    free(fs->cacheBucket);
+}
+
+/**
+ * Removes a directory (must be empty). Its whole chain goes back to the FAT
+ * and the last entry of its parent moves into its place.
+ */
+static int csc452_rmdir(const char *path)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    const char *last;
+    struct csc452_dir_cache *parent = NULL;
+    int res = 0;
+
+    pthread_rwlock_wrlock(&fs->rootLock);
+    long dirBlock = walk_path(fs, path, &last);
+    if (dirBlock < 0) {
+        res = dirBlock;
+    } else if (*last == '\0') {
+        res = -EBUSY;
+    } else if ((res = check_name(strlen(last))) == 0 && (parent = lock_directory(fs, dirBlock, 1)) == NULL) {
+        res = -EIO;
+    }
+    struct csc452_dir_bucket *bucket;
+    int i = parent != NULL ? find_file(fs, parent, last, strlen(last), &bucket) : 0;
+    if (parent != NULL && i < 0) {
+        res = i;
+    } else if (parent != NULL && bucket_entry(bucket, i)->type != CSC452_TYPE_DIR) {
+        res = -ENOTDIR;
+    } else if (parent != NULL) {
+        // No one else is in a directory while rootLock is held for writing,
+        // so the entry stays put while the child is checked on its own
+        long startBlock = bucket_entry(bucket, i)->nStartBlock;
+        unlock_directory(parent);
+        struct csc452_dir_cache *dir = lock_directory(fs, startBlock, 1);
+        if (dir == NULL) {
+            res = -EIO;
+        } else if (dir->head->nEntries > 0) {
+            res = -ENOTEMPTY;
+        }
+        if (dir != NULL) {
+            unlock_directory(dir);
+        }
+        pthread_rwlock_wrlock(&parent->lock);
+        if (res == 0) {
+            // The chain is freed once the parent is committed without it
+            remove_entry(fs, parent, bucket, i);
+            free_chain(fs, startBlock);
+            dir_forget(fs, dir);
+        }
+    }
+    if (parent != NULL) {
+        unlock_directory(parent);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+    if (res == 0) {
+        res = sync_all(fs);
+    }
+    return res;
+}
+
+/**
+ * Removes a file. The last entry in the directory moves into its place. The
+ * chain is freed right away unless the file is open, in which case the
+ * last close frees it.
+ */
+static int csc452_unlink(const char *path)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    const char *last;
+    struct csc452_dir_cache *dir = NULL;
+    int res = 0;
+
+    pthread_rwlock_rdlock(&fs->rootLock);
+    long dirBlock = walk_path(fs, path, &last);
+    if (dirBlock < 0) {
+        res = dirBlock;
+    } else if (*last == '\0') {
+        res = -EISDIR;
+    } else if ((res = check_name(strlen(last))) == 0 && (dir = lock_directory(fs, dirBlock, 1)) == NULL) {
+        res = -EIO;
+    }
+    struct csc452_dir_bucket *bucket;
+    int i = dir != NULL ? find_file(fs, dir, last, strlen(last), &bucket) : 0;
+    if (dir != NULL && i < 0) {
+        res = i;
+    } else if (dir != NULL && bucket_entry(bucket, i)->type == CSC452_TYPE_DIR) {
+        res = -EISDIR;
+    } else if (dir != NULL) {
+        long startBlock = bucket_entry(bucket, i)->nStartBlock;
+        remove_entry(fs, dir, bucket, i);
+
+        // New opens go through the entry, so none can start from here on
+        struct csc452_node *node;
+        pthread_mutex_lock(&fs->nodeLock);
+        for (node = fs->nodes[startBlock & (NODE_BUCKETS - 1)]; node != NULL; node = node->next) {
+            if (node->startBlock == startBlock) {
+                node->unlinked = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&fs->nodeLock);
+        if (node == NULL) {
+            free_chain(fs, startBlock);
+        }
+    }
+    if (dir != NULL) {
+        unlock_directory(dir);
+    }
+    pthread_rwlock_unlock(&fs->rootLock);
+    if (res == 0) {
+        res = sync_all(fs);
+    }
+    return res;
+}
+
+/**
+ * Frees the chain a truncate cut off a file. If read_buf has handed out
+ * segments of the file, a reply may still be reading them from the image,
+ * so the chain is held until the last reference to the node goes, which is
+ * after every open file that could have read it is released. If it can't
+ * be held it leaks, as free_later's chains do. The caller holds the node's
+ * lock for writing.
+ */
+static void truncate_free(struct csc452_fs *fs, struct csc452_node *node, long block)
+{
+    pthread_mutex_lock(&node->skipLock);
+    int spliced = node->spliced;
+    pthread_mutex_unlock(&node->skipLock);
+    if (!spliced) {
+        free_chain(fs, block);
+        return;
+    }
+    long *held = realloc(node->held, (node->nHeld + 1) * sizeof(long));
+    if (held != NULL) {
+        held[node->nHeld++] = block;
+        node->held = held;
+    }
+}
+
+/**
+ * Sets a file's size. Growing writes zeros onto the end, since freed blocks
+ * keep whatever they held. Shrinking sets the entry's size, then cuts the
+ * chain after the last block still needed and frees the rest in one pass
+ * once that is committed; every file keeps its first block. Open handles
+ * and the skip index forget the blocks that were cut.
+ */
+static int csc452_truncate(const char *path, off_t size)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    static const char zeros[ZERO_BYTES];
+
+    if (size < 0) {
+        return -EINVAL;
+    }
+    struct csc452_handle *handle;
+    int res = path_handle(fs, path, &handle);
+    if (res != 0) {
+        return res;
+    }
+    struct csc452_node *node = handle->node;
+
+    int shrink = 0;
+    pthread_rwlock_wrlock(&node->lock);
+    if (size > node->size) {
+        while (res == 0 && node->size < size) {
+            struct csc452_source src = {zeros, NULL};
+            size_t n = size - node->size < ZERO_BYTES ? size - node->size : ZERO_BYTES;
+            res = write_chain(fs, handle, &src, n, node->size);
+        }
+    } else if (size < node->size) {
+        node->size = size;
+        shrink = 1;
+    }
+    pthread_rwlock_unlock(&node->lock);
+
+    // The entry shrinks before the chain does, so no commit has an entry
+    // longer than its chain
+    int err = update_file_size(fs, handle);
+    if (res == 0) {
+        res = err;
+    }
+    if (res == 0 && shrink) {
+        pthread_rwlock_wrlock(&node->lock);
+        // Writes since may have taken the file past size again
+        long keep = (node->size + fs->blockSize - 1) / fs->blockSize;
+        if (keep < 1) {
+            keep = 1;
+        }
+        long block = handle_seek(fs, handle, keep - 1);
+        if (block != -1) {
+            pthread_mutex_lock(&fs->fatLock);
+            long next = cut_chain(fs, block);
+            pthread_mutex_unlock(&fs->fatLock);
+            if (next != FAT_EOC) {
+                truncate_free(fs, node, next);
+            }
+        }
+
+        pthread_mutex_lock(&node->skipLock);
+        if (node->skipLen > (keep - 1) / SKIP_STRIDE + 1) {
+            node->skipLen = (keep - 1) / SKIP_STRIDE + 1;
+        }
+        pthread_mutex_unlock(&node->skipLock);
+        node->cuts++;
+        pthread_rwlock_unlock(&node->lock);
+    }
+    if (res != 0) {
+        node_stale(fs, node->startBlock);
+    } else {
+        res = sync_all(fs);
+    }
+    close_handle(fs, handle);
+    return res;
+}
+
+/**
+ * Called when we open a file. The path is resolved here once and the
+ * handle is kept in fi->fh for every read and write until release.
+ */
+static int csc452_open(const char *path, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    /* We're not going to worry about permissions for this project, but
+	   if we were and we don't have them to the file we should return an error
+
+        return -EACCES;
+    */
+
+    struct csc452_handle *handle;
+    int res = path_handle(fs, path, &handle);
+    if (res != 0) {
+        return res;
+    }
+    fi->fh = (uintptr_t) handle;
+    fi->keep_cache = node_keep_cache(fs, handle->node->startBlock);
+    return 0; //success!
+}
+
+/**
+ * Called when the last reference to an open file goes away
+ */
+static int csc452_release(const char *path, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    (void) path;
+    struct csc452_handle *handle = (struct csc452_handle *) (uintptr_t) fi->fh;
+
+    int res = sync_handle(fs, handle);
+    close_handle(fs, handle);
+    fi->fh = 0;
+
+    // The last close of an unlinked file queued its chain; give it back now
+    pthread_mutex_lock(&fs->dirLock);
+    long queued = fs->nFreeLater;
+    pthread_mutex_unlock(&fs->dirLock);
+    if (res == 0 && queued > 0) {
+        res = sync_all(fs);
+    }
+    return res;
+}
+
+/**
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file
+ * again. Anything written through it is written back so close reports
+ * write errors.
+ */
+static int csc452_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    (void) path;
+
+    if (fi == NULL || fi->fh == 0) {
+        return 0;
+    }
+    return sync_handle(fs, (struct csc452_handle *) (uintptr_t) fi->fh);
+}
+
+
+/**
+ * Writes cached data, the FAT and directory sizes back and asks the OS to
+ * make the image durable
+ */
+static int csc452_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    struct csc452_fs *fs = fuse_get_context()->private_data;
+    (void) path;
+    (void) fi;
+
+    int res = sync_all(fs);
+    if (res == 0) {
+        res = disk_sync(fs, isdatasync);
+    }
+    return res;
+}
+
+
+//register our new functions as the implementations of the syscalls
+static struct fuse_operations csc452_oper = {
+        .getattr    = csc452_getattr,
+        .readdir    = csc452_readdir,
+        .mkdir    = csc452_mkdir,
+        .read    = csc452_read,
+#if FUSE_VERSION >= 29
+        .read_buf    = csc452_read_buf,
+#endif
+        .write    = csc452_write,
+#if FUSE_VERSION >= 29
+        .write_buf    = csc452_write_buf,
+#endif
+        .mknod    = csc452_mknod,
+        .truncate    = csc452_truncate,
+        .flush    = csc452_flush,
+        .fsync    = csc452_fsync,
+        .open    = csc452_open,
+        .release    = csc452_release,
+        .unlink    = csc452_unlink,
+        .rmdir    = csc452_rmdir,
+        .init    = csc452_init,
+        .destroy    = csc452_destroy
+};
+
+//Options we understand with -o; anything else is passed on to FUSE
+static const struct fuse_opt csc452_opts[] = {
+        {"image=%s", offsetof(struct csc452_fs, image), 0},
+        {"prealloc=%d", offsetof(struct csc452_fs, prealloc), 0},
+        {"attr_timeout=%lf", offsetof(struct csc452_fs, attrTimeout), 0},
+        {"entry_timeout=%lf", offsetof(struct csc452_fs, entryTimeout), 0},
+        {"blocksize=%d", offsetof(struct csc452_fs, blockSize), 0},
+        {"cache=%d", offsetof(struct csc452_fs, cacheBlocks), 0},
+        {"mmap", offsetof(struct csc452_fs, useMmap), 1},
+        {"noreadahead", offsetof(struct csc452_fs, noReadahead), 1},
+        {"uring", offsetof(struct csc452_fs, useUring), 1},
+        FUSE_OPT_END
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct csc452_fs *fs = malloc(sizeof(struct csc452_fs));
+    if (fs == NULL) {
+        return 1;
+    }
+    *fs = fsDefaults;
+    if (fuse_opt_parse(&args, fs, csc452_opts, NULL) == -1) {
+        return 1;
+    }
+
+    // FUSE leaves the working directory when it goes to the background
+    const char *image = fs->image != NULL ? fs->image : ".disk";
+    char *path = realpath(image, NULL);
+    if (path == NULL) {
+        fprintf(stderr, "csc452: cannot find %s: %s\n", image, strerror(errno));
+        return 1;
+    }
+    free(fs->image);
+    fs->image = path;
+
+    // FUSE keeps what the kernel caches for a second unless told otherwise
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%g,entry_timeout=%g", fs->attrTimeout, fs->entryTimeout);
+    if (fuse_opt_add_arg(&args, timeouts) == -1) {
+        return 1;
+    }
+
+    int res = fuse_main(args.argc, args.argv, &csc452_oper, fs);
+    fuse_opt_free_args(&args);
+    free(fs->image);
+    free(fs);
+    return res;
+}
@@ -0,0 +1,245 @@
+/*
+	Formats a csc452 image.
+
+	gcc -Wall -O2 csc452mkfs.c -o csc452mkfs
+
+	csc452mkfs [-b blocksize] [-s size] [-p] [-t] [image]
+
+	The image defaults to .disk and is created if it doesn't exist. Sizes
+	take a K, M, G or T suffix; without -s the image keeps its current
+	size. Whatever the image held before is discarded.
+
+	The image is cut back to nothing and regrown as a sparse file, so only
+	the blocks with something in them are written: the superblock and the
+	FAT blocks that cover the layout. Everything else reads as zeros, which
+	is an empty root, an empty journal and free FAT entries, and formatting
+	takes the same time at any size. For benchmarks, -p allocates the whole
+	image up front and -t goes further and writes every block, so the first
+	pass over the data doesn't pay for allocation.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "csc452fs.h"
+
+//bytes written at a time by -t
+#define TOUCH_BYTES (1 << 20)
+
+//held by the first block while a format is under way; it isn't blank and
+//isn't a superblock, so neither the driver nor fsck will take the image
+#define FORMAT_MARKER "csc452mkfs: format incomplete"
+
+/**
+ * pwrite until done
+ * @return 0 on success, or negative errno
+ */
+static int write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        buf = (const char *) buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Parses a size like 512M
+ * @return the size in bytes, or -1 if it isn't one
+ */
+static off_t parse_size(const char *text)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(text, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'T': case 't':
+            shift += 10;
+            /* fall through */
+        case 'G': case 'g':
+            shift += 10;
+            /* fall through */
+        case 'M': case 'm':
+            shift += 10;
+            /* fall through */
+        case 'K': case 'k':
+            shift += 10;
+            end++;
+            break;
+    }
+    if (errno != 0 || end == text || *end != '\0' || n > (unsigned long long) INT64_MAX >> shift) {
+        return -1;
+    }
+    return (off_t) (n << shift);
+}
+
+/**
+ * Writes the FAT blocks covering entries [from, to) with their initial
+ * values. FAT blocks outside these ranges are all free, and the sparse
+ * file already reads them as zeros.
+ * @return 0 on success, or negative errno
+ */
+static int write_fat(int fd, const csc452_superblock *sb, uint32_t *entries, uint64_t from, uint64_t to)
+{
+    uint64_t perBlock = CSC452_FAT_PER_BLOCK(sb->blockSize);
+    int res = 0;
+    for (uint64_t i = from / perBlock; res == 0 && i <= (to - 1) / perBlock; i++) {
+        for (uint64_t e = 0; e < perBlock; e++) {
+            entries[e] = initial_fat_entry(sb, i * perBlock + e);
+        }
+        res = write_all(fd, entries, sb->blockSize, (off_t) (sb->fatStart + i) * sb->blockSize);
+    }
+    return res;
+}
+
+/**
+ * Writes zeros over every block after the superblock so the file system
+ * under the image has all of it allocated and in its page cache
+ * @return 0 on success, or negative errno
+ */
+static int touch_image(int fd, const csc452_superblock *sb)
+{
+    char *zero = calloc(1, TOUCH_BYTES);
+    if (zero == NULL) {
+        return -ENOMEM;
+    }
+    int res = 0;
+    for (off_t off = sb->blockSize; res == 0 && off < (off_t) sb->fatStart * sb->blockSize; off += TOUCH_BYTES) {
+        off_t end = (off_t) sb->fatStart * sb->blockSize;
+        res = write_all(fd, zero, end - off < TOUCH_BYTES ? end - off : TOUCH_BYTES, off);
+    }
+    free(zero);
+    return res;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: csc452mkfs [-b blocksize] [-s size] [-p] [-t] [image]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int blockSize = DEFAULT_BLOCK_SIZE;
+    int prealloc = 0;
+    int touch = 0;
+    off_t size = -1;
+    while ((opt = getopt(argc, argv, "b:s:pt")) != -1) {
+        switch (opt) {
+            case 'b':
+                blockSize = atoi(optarg);
+                if (!valid_block_size(blockSize)) {
+                    fprintf(stderr, "csc452mkfs: blocksize must be a power of two from %d to %d\n",
+                            MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                    return 1;
+                }
+                break;
+            case 's':
+                if ((size = parse_size(optarg)) < 0) {
+                    fprintf(stderr, "csc452mkfs: bad size %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                prealloc = 1;
+                break;
+            case 't':
+                prealloc = touch = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind + 1 < argc) {
+        usage();
+    }
+    const char *image = optind < argc ? argv[optind] : ".disk";
+
+    struct stat st;
+    int fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "csc452mkfs: cannot open %s: %s\n", image, strerror(errno));
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "csc452mkfs: %s is not a regular file\n", image);
+        return 1;
+    }
+    if (size < 0) {
+        size = st.st_size;
+    }
+
+    csc452_superblock sb;
+    if (plan_superblock(&sb, size, blockSize) != 0) {
+        fprintf(stderr, "csc452mkfs: %lld bytes is not a size a %d byte block image can have\n",
+                (long long) size, blockSize);
+        return 1;
+    }
+
+    // Dropping the old contents leaves a hole that reads as zeros
+    int res = 0;
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, sb.diskSize) != 0) {
+        res = -errno;
+    }
+    if (res == 0 && prealloc) {
+        res = -posix_fallocate(fd, 0, sb.diskSize);
+    }
+    if (res == 0 && touch) {
+        res = touch_image(fd, &sb);
+    }
+
+    char *block = calloc(1, blockSize);
+    if (block == NULL) {
+        res = -ENOMEM;
+    }
+    // Mark the image first, or an interrupted format would leave a blank
+    // first block that the driver formats over with its own block size
+    if (res == 0) {
+        memcpy(block, FORMAT_MARKER, sizeof(FORMAT_MARKER));
+        res = write_all(fd, block, blockSize, 0);
+    }
+    if (res == 0 && fsync(fd) != 0) {
+        res = -errno;
+    }
+    if (res == 0) {
+        uint64_t layoutEnd = sb.journalBlocks > 0 ? sb.journalStart + sb.journalBlocks : sb.rootBlock + 1;
+        res = write_fat(fd, &sb, (uint32_t *) block, 0, layoutEnd);
+    }
+    if (res == 0) {
+        res = write_fat(fd, &sb, (uint32_t *) block, sb.fatStart, sb.nBlocks);
+    }
+    // The superblock replaces the marker last
+    if (res == 0) {
+        memset(block, 0, blockSize);
+        memcpy(block, &sb, sizeof(sb));
+        res = write_all(fd, block, blockSize, 0);
+    }
+    if (res == 0 && fsync(fd) != 0) {
+        res = -errno;
+    }
+    free(block);
+    close(fd);
+
+    if (res != 0) {
+        fprintf(stderr, "csc452mkfs: cannot format %s: %s\n", image, strerror(-res));
+        return 1;
+    }
+    printf("%s: %llu blocks of %u bytes, %llu for data, %llu in the journal\n", image,
+           (unsigned long long) sb.nBlocks, sb.blockSize,
+           (unsigned long long) (sb.fatStart - sb.rootBlock - 1 - sb.journalBlocks),
+           (unsigned long long) sb.journalBlocks);
+    return 0;
+}